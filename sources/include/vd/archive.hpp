@@ -1,3 +1,5 @@
+#pragma once
+
 #include <stdio.h>
 
 #ifdef _MSC_VER
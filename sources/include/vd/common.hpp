@@ -12,6 +12,8 @@
 #include <deque>
 #include <iomanip>
 #include <memory>
+#include <algorithm>
+#include <atomic>
 #include <QString>
 
 #ifdef Q_OS_WIN32
@@ -115,55 +117,97 @@ public:
 
 std::ostream& operator << (std::ostream& out, const QString& str);
 
+/// Ring of single producer and single consumer threads. Neither side
+/// locks or waits: write takes what fits, read gives what there is.
 template <typename T>
 class CircularBuffer
 {
 public:
 
-	CircularBuffer::CircularBuffer(size_t elems)
-	:	buf_(new T[bytes]),
-		last_(buf_ + bytes),
-		start_(buf_),
-		end_(buf_)
+	CircularBuffer(size_t elems)
+	:	buf_(new T[elems + 1]),
+		size_(elems + 1),
+		read_(0),
+		write_(0),
+		underruns_(0)
 	{
 	}
 
-	void CircularBuffer::write(T* ptr, size_t elems)
+	~CircularBuffer()
 	{
-		 
+		delete [] buf_;
 	}
 
-	void CircularBuffer::read(T* ptr, size_t elems) const
+	/// Producer side. Returns elements written, fewer when ring is full.
+	size_t write(const T* ptr, size_t elems)
 	{
-		 
-	}
+		size_t w = write_.load(std::memory_order_relaxed);
+		size_t r = read_.load(std::memory_order_acquire);
 
-	bool CircularBuffer::has(size_t elems) const
-	{
-		if (end_ >= start_)
-			return end_ - start_ >= bytes; 
-		else
-			return (last_ - buf_) - (start_ - end_) >= bytes;
+		elems = std::min(elems, (r + size_ - w - 1) % size_);
+		size_t first = std::min(elems, size_ - w);
+		std::copy(ptr, ptr + first, buf_ + w);
+		std::copy(ptr + first, ptr + elems, buf_);
+
+		write_.store((w + elems) % size_, std::memory_order_release);
+		return elems;
 	}
 
-protected:
-	
-	T* CircularBuffer::index(T* ptr)
+	/// Consumer side. Returns elements read, fewer ones are counted as underrun.
+	size_t read(T* ptr, size_t elems)
 	{
-		if (ptr > last_)
+		size_t r = read_.load(std::memory_order_relaxed);
+		size_t w = write_.load(std::memory_order_acquire);
+
+		size_t avail = (w + size_ - r) % size_;
+		if (avail < elems)
 		{
-			T* c = start_ + (ptrdiff_t )(ptr - last_);
-			VD_ASSERT2(c < last_, "Bad request");
-			return c;
+			underruns_.fetch_add(1, std::memory_order_relaxed);
+			elems = avail;
 		}
-		return ptr;
+
+		size_t first = std::min(elems, size_ - r);
+		std::copy(buf_ + r, buf_ + r + first, ptr);
+		std::copy(buf_, buf_ + elems - first, ptr + first);
+
+		read_.store((r + elems) % size_, std::memory_order_release);
+		return elems;
+	}
+
+	/// Consumer side. Drops everything written so far.
+	void clear()
+	{
+		read_.store(write_.load(std::memory_order_acquire), std::memory_order_release);
 	}
 
+	/// Elements ready to read. Exact for consumer, lower bound for producer.
+	size_t size() const
+	{
+		size_t r = read_.load(std::memory_order_acquire);
+		size_t w = write_.load(std::memory_order_acquire);
+		return (w + size_ - r) % size_;
+	}
+
+	size_t capacity() const { return size_ - 1; }
+
+	size_t free() const { return capacity() - size(); }
+
+	bool has(size_t elems) const { return size() >= elems; }
+
+	/// Reads which got less than asked
+	size_t underruns() const { return underruns_.load(std::memory_order_relaxed); }
+
+protected:
+	CircularBuffer(const CircularBuffer&);
+	CircularBuffer& operator = (const CircularBuffer&);
+
 protected:
 	T* buf_;
-	T* last_;
-	T* start_;
-	T* end_;
+	/// One element is always left empty to tell full ring from empty one
+	size_t size_;
+	std::atomic<size_t> read_;
+	std::atomic<size_t> write_;
+	std::atomic<size_t> underruns_;
 };
 
 template <typename T>
@@ -4,6 +4,11 @@
 #include "common.hpp"
 #include "sdl.hpp"
 #include "proto.hpp"
+#include "archive.hpp"
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QFile>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -23,6 +28,47 @@ public:
 protected:
 };
 
+/// Local file mapped into memory behind custom AVIOContext. Reads are 
+/// copies from mapping without syscalls, readahead hints follow the reads.
+class FfmpegMappedIo
+{
+public:
+	FfmpegMappedIo();
+	~FfmpegMappedIo();
+
+	bool open(const AString& filename);
+
+	AVIOContext* context() { return io_ctx_; }
+
+protected:
+	static int read_packet(void* opaque, uint8_t* buf, int size);
+	static int64_t seek(void* opaque, int64_t offset, int whence);
+
+	/// Asks kernel to read window after pos_ when reads come close to its end
+	void advise();
+
+protected:
+	QFile file_;
+	uchar* data_;
+	int64_t size_;
+	int64_t pos_;
+
+	int64_t advised_from_;
+	int64_t advised_to_;
+
+	AVIOContext* io_ctx_;
+};
+
+/// Packets read for one stream and not yet taken by decoder. Payloads are
+/// refcounted buffers of demuxer, shells belong to FfmpegDemuxer.
+struct FfmpegPacketQueue
+{
+	std::deque<AVPacket*> packets;
+	size_t bytes;
+
+	FfmpegPacketQueue() : bytes(0) {}
+};
+
 struct FfmpegStream
 {
 	enum Type
@@ -33,9 +79,85 @@ struct FfmpegStream
 
 	AVCodecContext* codec_ctx;
 	AVCodec* codec;
+	AVRational time_base;
 	Type type;
 	int stream_id;
-	std::deque<AVPacket> pool;
+	FfmpegPacketQueue pool;
+
+	/// Stream is discarded by format context while nobody wants it
+	int subscribers;
+
+	/// After seek frames before preroll_to are decoded cheaply and dropped
+	bool prerolling;
+	time_mark preroll_to;
+
+	/// Demuxer and codec are drained, till next seek
+	bool finished;
+
+	/// Unique per opened codec, never reused like its address
+	u64 source;
+	/// Changes when codec is flushed by seek: frames of one serial are continuous
+	u64 serial;
+};
+
+/// Reads packets of FfmpegDecodingState on its own thread. Stream pools 
+/// are bounded: reader sleeps while any pool is full and nobody starves.
+class FfmpegDemuxer : public QThread
+{
+public:
+	FfmpegDemuxer(FfmpegDecodingState* state);
+	~FfmpegDemuxer();
+
+	/// Blocks until packet for stream is ready. Returns false when stream finished.
+	/// Packet payload is moved to caller and must be freed by caller then.
+	bool pop(size_t stream_id, AVPacket* packet);
+
+	/// Seeks format context in the stream time base and drops all read packets
+	bool seek(int stream_index, int64_t target, int flags);
+
+	size_t queued_bytes();
+
+	/// Changes subscribers of stream. Stream without them is discarded.
+	void subscribe(size_t stream_id, int delta);
+
+	void stop();
+
+	void set_limits(size_t max_packets, size_t max_bytes);
+
+protected:
+	void run() VD_OVERRIDE;
+
+	bool full() const;
+
+	bool wanted() const;
+
+	void flush_pools();
+	void flush_pool(FfmpegPacketQueue& pool);
+
+	AVPacket* take_shell();
+	void give_shell(AVPacket* shell);
+
+protected:
+	FfmpegDecodingState* state_;
+
+	/// Spare AVPacket structs, so reading doesn't allocate them
+	std::vector<AVPacket*> shells_;
+
+	/// Guards format context, held only by reading and seeking
+	QMutex io_mutex_;
+
+	/// Guards pools and flags below
+	QMutex mutex_;
+	QWaitCondition readable_;
+	QWaitCondition writable_;
+
+	bool stop_;
+	bool eof_;
+	/// Bumped by seek, packet or EOF read before it is stale
+	unsigned generation_;
+	int starving_;
+	size_t max_packets_;
+	size_t max_bytes_;
 };
 
 class FfmpegFrame : public IFrame 
@@ -45,11 +167,52 @@ public:
 
 	~FfmpegFrame();
 
+	time_mark duration() const VD_OVERRIDE;
+
 protected:
 public:
 	AVFrame* frame;
 	AVCodecContext* codec_ctx;
 	size_t data_sz;
+
+	/// Of stream it was decoded from
+	u64 source;
+	u64 serial;
+
+	/// Where frame returns after last reference dies
+	FfmpegFramePoolPtr pool;
+};
+
+/// Recycles AVFrames of one decoding state. Decoded buffers are refcounted
+/// by codec, so returned frame gives its buffers back to codec pools too.
+class FfmpegFramePool
+{
+public:
+	FfmpegFramePool(size_t max_bytes);
+	~FfmpegFramePool();
+
+	/// Empty frame to decode into, nullptr while frames in use are over 
+	/// memory limit. Never waits: caller holds its decoding state.
+	AVFrame* acquire();
+
+	void release(AVFrame* frame);
+
+	/// Counts decoded frame as used memory
+	void account(AVFrame* frame);
+
+	void set_max_bytes(size_t max_bytes);
+
+	size_t used_bytes() const { return used_bytes_; }
+
+protected:
+	static size_t frame_bytes(const AVFrame* frame);
+
+protected:
+	QMutex mutex_;
+
+	std::vector<AVFrame*> free_;
+	size_t used_bytes_;
+	size_t max_bytes_;
 };
 
 class FfmpegDecodingState : public DecodingState 
@@ -58,11 +221,40 @@ public:
 	friend class FfmpegDecoder;
 
 	FfmpegDecodingState();
+	~FfmpegDecodingState();
 
 	IFramePtr peek_frame(size_t stream_id) VD_OVERRIDE;
 
+	bool finished(size_t stream_id) const VD_OVERRIDE;
+
+	void subscribe(size_t stream_id) VD_OVERRIDE;
+	void unsubscribe(size_t stream_id) VD_OVERRIDE;
+
 	void seek(time_mark t) VD_OVERRIDE;
 
+	void seek_key(time_mark t) VD_OVERRIDE;
+
+	size_t preroll() const VD_OVERRIDE { return preroll_; }
+
+	time_mark position() const VD_OVERRIDE { return position_; }
+
+	bool key_only() const VD_OVERRIDE { return key_only_; }
+
+	bool open() VD_OVERRIDE;
+	void close() VD_OVERRIDE;
+	bool is_open() const VD_OVERRIDE;
+	bool try_close() VD_OVERRIDE;
+
+	size_t memory() const VD_OVERRIDE { return memory_; }
+
+	time_mark used_at() const VD_OVERRIDE { return used_at_; }
+
+	void interrupt() VD_OVERRIDE { interrupted_ = true; }
+
+	void set_keyframes(KeyframeIndexPtr keyframes) VD_OVERRIDE { keyframes_ = keyframes; }
+
+	bool build_keyframes(KeyframeIndex* keyframes) VD_OVERRIDE;
+
 	time_mark length() const VD_OVERRIDE;
 
 	time_mark time_base(size_t stream_id) const VD_OVERRIDE;
@@ -70,29 +262,178 @@ public:
 	int width() const VD_OVERRIDE;
 	int height() const VD_OVERRIDE;
 
+	/// Cap for decoded frames which are alive at once
+	void set_frame_memory_limit(size_t bytes);
+
 protected:
 
-	bool read();
+	void start_demuxer();
 
-	void flush_pools();
+	/// Reopens closed state at its position. Expects mutex_ locked.
+	bool ensure_open();
+
+	void release();
+
+	/// Counts memory() anew. Expects mutex_ locked.
+	void update_memory();
+
+	void do_seek(time_mark t);
+
+	/// Video codecs skip everything but keyframes and loop filter
+	void set_key_only(bool key_only);
+
+	/// Reads all packets of file when container has no sample index
+	bool scan_keyframes(KeyframeIndex* keyframes);
+
+	time_mark frame_time(const FfmpegStream& stream, AVFrame* frame) const;
+	time_mark packet_time(const FfmpegStream& stream, const AVPacket& packet) const;
 
 public:
 
 	AVFormatContext* format_ctx_;
+	std::unique_ptr<FfmpegMappedIo> io_;
 	std::vector<FfmpegStream> streams_;
 	SwsContext* conv_ctx_;
 	IFramePtr prev_frame_;
 	time_mark offset_;
+	std::unique_ptr<FfmpegDemuxer> demuxer_;
+	FfmpegFramePoolPtr frames_;
+	KeyframeIndexPtr keyframes_;
+	size_t preroll_;
+	time_mark position_;
+	time_mark used_at_;
+	AString filename_;
+	DecodingPolicy policy_;
+	int width_;
+	int height_;
+	bool key_only_;
+
+	/// Guards against closing while decoding
+	mutable QMutex mutex_;
+
+	/// Set without mutex_, it's held by decoding which is interrupted
+	std::atomic<bool> interrupted_;
+
+	/// Published for decoder budget, which never waits for decoding
+	std::atomic<bool> open_;
+	std::atomic<size_t> memory_;
+};
+
+/// What av_find_stream_info found out about file
+struct FfmpegProbeRecord
+{
+	struct Stream
+	{
+		int codec_type;
+		int codec_id;
+		int width;
+		int height;
+		int pix_fmt;
+		int sample_rate;
+		int channels;
+		int sample_fmt;
+		int64_t channel_layout;
+		int frame_rate_num;
+		int frame_rate_den;
+		int64_t duration;
+		/// Reorder delay, keyframe index depends on it
+		int has_b_frames;
+		int time_base_num;
+		int time_base_den;
+	};
+
+	/// File identity, record is stale when they differ
+	int64_t file_size;
+	int64_t file_mtime;
+
+	int64_t duration;
+	std::vector<Stream> streams;
+
+	FfmpegProbeRecord() : file_size(0), file_mtime(0), duration(0) {}
+
+	void fill(const AVFormatContext* format_ctx);
+
+	/// Sets what header doesn't tell. False when layout doesn't match file.
+	bool apply(AVFormatContext* format_ctx) const;
+
+	void fill(MediaInfo* info) const;
+};
+
+template <typename _Arch>
+void archive(FfmpegProbeRecord::Stream& s, _Arch& arch)
+{
+	bike::arch_int(s.codec_type, arch);
+	bike::arch_int(s.codec_id, arch);
+	bike::arch_int(s.width, arch);
+	bike::arch_int(s.height, arch);
+	bike::arch_int(s.pix_fmt, arch);
+	bike::arch_int(s.sample_rate, arch);
+	bike::arch_int(s.channels, arch);
+	bike::arch_int(s.sample_fmt, arch);
+	bike::arch_simple(s.channel_layout, arch);
+	bike::arch_int(s.frame_rate_num, arch);
+	bike::arch_int(s.frame_rate_den, arch);
+	bike::arch_simple(s.duration, arch);
+	bike::arch_int(s.has_b_frames, arch);
+	bike::arch_int(s.time_base_num, arch);
+	bike::arch_int(s.time_base_den, arch);
+}
+
+template <typename _Arch>
+void archive(FfmpegProbeRecord& r, _Arch& arch)
+{
+	bike::arch_simple(r.file_size, arch);
+	bike::arch_simple(r.file_mtime, arch);
+	bike::arch_simple(r.duration, arch);
+
+	unsigned int count = (unsigned int) r.streams.size();
+	bike::arch_uint(count, arch);
+	r.streams.resize(std::min(count, 64u));
+	for (size_t i = 0; i < r.streams.size(); ++i)
+		bike::arch_struct(r.streams[i], arch);
+}
+
+/// Probe records by file path, in memory and in cache directory
+class FfmpegProbeCache
+{
+public:
+	FfmpegProbeCache();
+	~FfmpegProbeCache();
+
+	bool load(const AString& filename, FfmpegProbeRecord* record);
+
+	void store(const AString& filename, FfmpegProbeRecord record);
+
+	static FfmpegProbeCache& i() { VD_ASSERT2(instance_, "FfmpegProbeCache singleton wasn't created"); return *instance_; }
+
+protected:
+	static bool identity(const AString& filename, int64_t* size, int64_t* mtime);
+
+	AString record_path(const AString& filename) const;
+
+protected:
+	static FfmpegProbeCache* instance_;
+
+	QMutex mutex_;
+	std::map<AString, FfmpegProbeRecord> records_;
+	AString dir_;
 };
 
 class FfmpegDecoder : public Decoder 
 {
 public:
-	DecodingState* try_decode(const AString& filename);
+	DecodingState* try_decode(const AString& filename, const DecodingPolicy& policy) VD_OVERRIDE;
+
+	bool probe(const AString& filename, MediaInfo* info) VD_OVERRIDE;
+
+	/// Opens file into the closed state
+	bool open(FfmpegDecodingState* state, const AString& filename, const DecodingPolicy& policy);
 
 protected:
 
-	bool fill_stream_data(FfmpegStream* data, const AVFormatContext* format_ctx, int stream_id);
+	bool fill_stream_data(FfmpegStream* data, const AVFormatContext* format_ctx, int stream_id, const DecodingPolicy& policy);
+
+	void apply_threading(AVCodecContext* codec_ctx, const DecodingPolicy& policy);
 };
 
 }// namespace vd
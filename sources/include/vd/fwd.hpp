@@ -27,10 +27,13 @@ class Compositor;
 class IFramePresenter;
 
 class Media;
+class KeyframeIndex;
 class MediaObject;
 class MediaClip;
 
 class FfmpegDecodingState;
+class FfmpegDemuxer;
+class FfmpegFramePool;
 class TimeLineTrack;
 class Project;
 class SdlRenderer;
@@ -42,6 +45,8 @@ class DecodingState;
 
 class SdlBlitter;
 class SdlVideoFrame;
+class SdlAudioFrame;
+class SdlAudioProducer;
 class FfmpegFrame;
 
 class Scene;
@@ -58,6 +63,8 @@ class Compositor;
 class MovieResource;
 class Preview;
 class PreviewState;
+class MediaPrefetcher;
+class MediaPreroller;
 struct PreviewPreset;
 
 typedef std::string AString;
@@ -71,6 +78,7 @@ typedef std::shared_ptr<TimeLineRectWidget> TimeLineRectPtr;
 
 typedef std::shared_ptr<IFrame> IFramePtr;
 typedef std::shared_ptr<Media> MediaPtr;
+typedef std::shared_ptr<KeyframeIndex> KeyframeIndexPtr;
 typedef std::shared_ptr<MediaObject> MediaObjectPtr;
 typedef std::unique_ptr<MediaClip> MediaClipUPtr;
 
@@ -91,6 +99,7 @@ typedef std::weak_ptr<TimeLineTrack> TimeLineTrackWPtr;
 typedef std::shared_ptr<TimeLineSceneWidget> TimeLineSceneWidgetPtr;
 
 typedef std::shared_ptr<DecodingState> DecodingStatePtr;
+typedef std::shared_ptr<FfmpegFramePool> FfmpegFramePoolPtr;
 
 typedef std::shared_ptr<Scene> ScenePtr;
 typedef std::shared_ptr<Modifier> ModifierPtr;
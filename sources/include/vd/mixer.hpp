@@ -0,0 +1,59 @@
+/** VD */
+#pragma once
+
+#include <vd/common.hpp>
+
+namespace vd {
+
+/// Kernels of audio mixer. SSE2 when compiler targets it, scalar otherwise.
+namespace mix {
+
+/// dst += src * gain
+void add(float* dst, const float* src, float gain, size_t n);
+
+/// dst = clip(src * gain * 32767 + dither)
+void float_to_s16(const float* src, const float* dither, float gain, int16_t* dst, size_t n);
+
+}// namespace mix
+
+/// Sums tracks on float planar bus. Tracks come interleaved float, as
+/// resampler gives them, and bus is dithered and clipped to device S16
+/// once at the end.
+class AudioMixer
+{
+public:
+	AudioMixer();
+
+	void set_format(int channels);
+
+	/// Clears bus for block of samples
+	void begin(size_t samples);
+
+	/// Adds samples of one track at offset of block
+	void add(const float* src, size_t offset, size_t samples, float gain);
+
+	/// Writes block with master gain applied
+	void end(float gain, int16_t* dst);
+
+	int channels() const { return channels_; }
+
+	size_t block() const { return block_; }
+
+protected:
+	/// Triangular noise of one LSB
+	void fill_dither(size_t n);
+
+protected:
+	int channels_;
+	size_t block_;
+	std::vector<std::vector<float> > bus_;
+
+	/// Scratch buffers, kept between blocks
+	std::vector<float> plane_;
+	std::vector<float> dither_;
+	std::vector<int16_t> out_;
+
+	uint32_t seed_;
+};
+
+}// namespace vd
@@ -3,6 +3,7 @@
 
 #include <vd/common.hpp>
 #include <vd/timeline.hpp>
+#include <QMutex>
 #include <QObject>
 #include <QScrollBar>
 #include <SDL/SDL.h>
@@ -42,6 +43,16 @@ public:
 	time_mark pts() const { return pts_; }
 	void set_pts(time_mark pts) { pts_ = pts; }
 
+	/// Zero for video frames, they're shown from pts
+	virtual time_mark duration() const { return 0; }
+
+	/// Nothing of it is at or after t. Audio frame over t isn't, it's trimmed.
+	bool ends_before(time_mark t) const 
+	{ 
+		time_mark d = duration();
+		return d? pts_ + d <= t : pts_ < t;
+	}
+
 protected:
 	time_mark pts_;
 };
@@ -92,6 +103,91 @@ protected:
 	IFrameManager* mgr_;
 };
 
+/// How codec of a stream spreads its work between cores
+struct DecodingPolicy
+{
+	enum Threading
+	{
+		TH_SINGLE,
+		TH_SLICE, ///< Parts of one frame in parallel. Low latency, for preview
+		TH_FRAME, ///< Several frames in flight. High throughput, for export
+		TH_AUTO   ///< Everything codec supports
+	};
+
+	Threading threading;
+
+	/// Zero means number of cores
+	int threads;
+
+	/// Local file is read through memory mapping instead of file protocol
+	bool mapped_io;
+
+	DecodingPolicy(Threading th = TH_AUTO, int thr = 0, bool mapped = false) : threading(th), threads(thr), mapped_io(mapped) {}
+
+	static DecodingPolicy preview() { return DecodingPolicy(TH_SLICE, 0, true); }
+	static DecodingPolicy render()  { return DecodingPolicy(TH_FRAME); }
+};
+
+bool operator < (const DecodingPolicy& a, const DecodingPolicy& b);
+
+/// Keyframes of media video stream sorted by pts
+class KeyframeIndex
+{
+public:
+	struct Entry
+	{
+		/// Presentation time
+		time_mark pts;
+		/// Same in stream time base, for seeking
+		int64_t timestamp;
+		/// Byte offset in file, -1 if unknown
+		int64_t pos;
+		/// Frames till next keyframe
+		int gop;
+	};
+
+	KeyframeIndex() : frame_duration_(0) {}
+
+	void add(const Entry& entry);
+
+	bool empty() const { return entries_.empty(); }
+	size_t size() const { return entries_.size(); }
+
+	/// Last keyframe at or before t. nullptr when t is before the first one.
+	const Entry* find(time_mark t) const;
+
+	/// First keyframe after t. nullptr when there is none.
+	const Entry* after(time_mark t) const;
+
+	/// Frames to decode from keyframe to reach t
+	size_t preroll(const Entry& key, time_mark t) const;
+
+	void set_frame_duration(time_mark duration) { frame_duration_ = duration; }
+	time_mark frame_duration() const { return frame_duration_; }
+
+	const std::vector<Entry>& entries() const { return entries_; }
+
+protected:
+	std::vector<Entry> entries_;
+	time_mark frame_duration_;
+};
+
+/// Cheap facts about media file, known without opening codecs
+struct MediaInfo
+{
+	bool probed;
+	bool has_video;
+	bool has_audio;
+	int width;
+	int height;
+	int sample_rate;
+	int channels;
+	time_mark duration;
+
+	MediaInfo() : probed(false), has_video(false), has_audio(false), width(0), height(0), 
+		sample_rate(0), channels(0), duration(0) {}
+};
+
 class Media 
 {
 public:
@@ -99,23 +195,91 @@ public:
 
 	const AString& filename() const { return filename_; }
 
-	DecodingStatePtr decoder();
+	void set_decoding_policy(const DecodingPolicy& policy) { policy_ = policy; }
+	const DecodingPolicy& decoding_policy() const { return policy_; }
+
+	/// Probed on first request, doesn't open decoder. Copy, as it's
+	/// asked from prefetch and decoding threads.
+	MediaInfo info();
+
+	/// Built when media is opened first time
+	KeyframeIndexPtr keyframes() const;
+	void set_keyframes(KeyframeIndexPtr keyframes);
 
 protected:
 
 	AString filename_;
 
-	DecodingStatePtr decoder_;
+	DecodingPolicy policy_;
+
+	KeyframeIndexPtr keyframes_;
+
+	MediaInfo info_;
+
+	/// Held while probing, so file is probed once
+	QMutex info_mutex_;
+	/// Guards keyframes_ pointer only
+	mutable QMutex keyframes_mutex_;
 };
 
 
 class DecodingState 
 {
 public:
+	virtual ~DecodingState() {}
+
+	/// Next frame of stream. Nothing comes at its end, but also while 
+	/// decoded frames are over memory limit or seek is interrupted.
 	virtual IFramePtr peek_frame(size_t stream_id) = 0;
 
+	/// Stream is decoded till its end, it's what empty peek_frame() means then
+	virtual bool finished(size_t stream_id) const = 0;
+
+	/// Only streams somebody subscribed are read from media
+	virtual void subscribe(size_t stream_id) = 0;
+	virtual void unsubscribe(size_t stream_id) = 0;
+
 	virtual void seek(time_mark t) = 0;
 
+	/// Lands on keyframe at or before t without pre-roll. Only keyframes
+	/// are decoded till next accurate seek, for scrubbing.
+	virtual void seek_key(time_mark t) = 0;
+
+	/// Frames still to decode and drop after the last seek to reach its
+	/// target. Counts down, untimed frames are dropped by it.
+	virtual size_t preroll() const = 0;
+
+	/// Media time of the last seek or decoded frame
+	virtual time_mark position() const = 0;
+
+	/// Decodes only keyframes since seek_key()
+	virtual bool key_only() const = 0;
+
+	/// Closed state keeps its position and subscriptions and reopens itself 
+	/// on next use
+	virtual bool open() = 0;
+	virtual void close() = 0;
+	virtual bool is_open() const = 0;
+
+	/// Closes unless state is decoding right now
+	virtual bool try_close() = 0;
+
+	/// Approximate bytes held by open state, as of the last decoding. 
+	/// Doesn't wait for decoding, nor does is_open().
+	virtual size_t memory() const = 0;
+
+	/// av_gettime() of the last decoding or seek
+	virtual time_mark used_at() const = 0;
+
+	/// Makes running pre-roll after seek give up, may be called from 
+	/// any thread. Next seek clears it.
+	virtual void interrupt() = 0;
+
+	virtual void set_keyframes(KeyframeIndexPtr keyframes) = 0;
+
+	/// Fills index of keyframes when it's empty
+	virtual bool build_keyframes(KeyframeIndex* keyframes) = 0;
+
 	virtual time_mark length() const = 0;
 
 	virtual time_mark time_base(size_t stream_id) const = 0;
@@ -129,7 +293,10 @@ protected:
 class Decoder
 {
 public:
-	virtual DecodingState* try_decode(const AString& filename) = 0;	
+	virtual DecodingState* try_decode(const AString& filename, const DecodingPolicy& policy) = 0;
+
+	/// Reads only container header
+	virtual bool probe(const AString& filename, MediaInfo* info) = 0;	
 };
 
 class Preview : public QObject
@@ -138,6 +305,7 @@ class Preview : public QObject
 public:
 
 	Preview(SdlRenderer* renderer);
+	~Preview();
 
 	void bind(Project* project);
 
@@ -149,10 +317,35 @@ public:
 
 	bool paused() const { return pause_; }
 
+	/// Runs in preview thread
 	void seek(time_mark t);
 
+	/// Called from UI. Only the latest target is served, seek which is
+	/// already running for older one is interrupted.
+	void post_seek(time_mark t);
+
+	/// While cursor is dragged posted seeks show nearest keyframe. When 
+	/// it's off, the last target is decoded accurately.
+	void set_scrubbing(bool scrubbing);
+
+	/// Keyframe near t, runs in preview thread
+	void scrub(time_mark t);
+
 	SdlAudio* audio() { return audio_; }
 	
+protected:
+	void prefetch();
+
+	/// Runs posted seek if there is one
+	void serve_seek();
+
+	/// Timeline time which is heard now, zero without audio device.
+	/// Video follows it, so output latency is compensated.
+	time_mark audio_clock();
+
+	/// Newer target was posted while seeking
+	bool seek_superseded();
+
 protected:
 
 public slots:
@@ -175,9 +368,22 @@ protected:
 	bool pause_;
 	time_mark playing_;
 	time_mark prev_frame_;
-
-	//QMutex mutex_;
-	//QWaitCondition wait_;
+	MediaPrefetcher* prefetcher_;
+	SdlAudioProducer* producer_;
+
+	/// Guards pause, stop and seek requests. Playback thread sleeps on
+	/// wait_ till frame deadline or till one of them comes.
+	QMutex mutex_;
+	QWaitCondition wait_;
+
+	time_mark seek_target_;
+	bool seek_pending_;
+	bool seeking_;
+	bool scrubbing_;
+	/// Posted target is for scrubbing
+	bool seek_scrub_;
+	/// Some scrubbing seek was posted since drag started
+	bool scrubbed_;
 };
 
 }// namespace vd
@@ -6,13 +6,16 @@
 #include <vd/timeline.hpp>
 #include <QWidget>
 #include <QMutex>
+#include <QWaitCondition>
 #include <SDL/SDL.h>
+#include <map>
 
 extern "C" {
 #include <libswresample/swresample.h>
 }
 
 struct SwsContext;
+struct AVCodecContext;
 
 namespace vd {
 
@@ -42,12 +45,14 @@ public:
 	friend class SdlBlitter;
 	friend class SdlRenderer;
 
-	SdlVideoFrame(SDL_Overlay* overlay);
+	SdlVideoFrame(SDL_Overlay* overlay, QMutex* mutex);
 
 	~SdlVideoFrame();
 
 protected:
 	SDL_Overlay* overlay_;
+	/// Renderer lock, overlay is freed under it
+	QMutex* mutex_;
 };
 
 class SdlAudioBuffer : public IFrame
@@ -109,6 +114,9 @@ protected:
 	SdlAudio* audio_;
 
 	SdlFfmpegAudioDecoder* audio_decoder_;
+
+	/// Playback and preroll threads share one decoder
+	QMutex mutex_;
 };
 
 
@@ -117,9 +125,25 @@ class SdlAudioFrame : public IFrame
 public:
 	SdlAudioFrame();
 
+	size_t samples() const { return sample_bytes? size / sample_bytes : 0; }
+
+	time_mark duration() const VD_OVERRIDE { return freq > 0? samples() * AV_TIME_BASE / freq : 0; }
+
+	/// Drops samples from both ends, pts moves with the head
+	void trim(size_t head, size_t tail);
+
 	static const size_t buf_allocated = 4096 * 48;
 	uint8_t buf[buf_allocated];
 	size_t size;
+
+	int freq;
+	/// Interleaved, track frames are float and mixed ones device S16
+	AVSampleFormat format;
+	/// Bytes of one sample of all channels
+	int sample_bytes;
+
+	/// PreviewState::audio_serial() of mix, older ones aren't played
+	u64 serial;
 };
 
 class SdlFfmpegAudioDecoder
@@ -127,11 +151,41 @@ class SdlFfmpegAudioDecoder
 public:
 
 	SdlFfmpegAudioDecoder(SdlAudio* audio);
+	~SdlFfmpegAudioDecoder();
 
 	bool decode(SdlAudioFrame* dst_frame, FfmpegFrame* src_frame);
 
+	/// Tracks are resampled to float in device layout, mixer converts
+	/// them to device format only once for the sum
+	static const AVSampleFormat track_format = AV_SAMPLE_FMT_FLT;
+
+protected:
+	/// Resampler keeps its filter history between frames of one stream
+	struct Resampler
+	{
+		SwrContext* ctx;
+		int64_t channel_layout;
+		int format;
+		int sample_rate;
+		int out_rate;
+		/// Seek serial of the last frame, history is dropped when it changes
+		u64 serial;
+		u64 used;
+	};
+
+	/// Resampler of frame source stream, rebuilt when input changes
+	SwrContext* resampler(FfmpegFrame* src_frame);
+
+	/// Drops resamplers of closed sources, they're never used again
+	void evict();
+
 protected:
 	SdlAudio* audio_;
+
+	/// By FfmpegFrame::source
+	typedef std::map<u64, Resampler> Resamplers;
+	Resamplers resamplers_;
+	u64 clock_;
 };
 
 
@@ -142,8 +196,34 @@ class SdlAudio
 public:
 	SdlAudio();
 
+	/// Output latency traded against robustness on loaded machine.
+	/// Sizes device buffer and ring together.
+	enum Latency
+	{
+		L_LOW,    ///< 256 samples device buffer, for scrubbing and lip-sync review
+		L_NORMAL, ///< 1024 samples
+		L_SAFE    ///< 4096 samples, survives long stalls
+	};
+
+	/// Applied on next open()
+	void set_latency(Latency latency) { latency_ = latency; }
+	Latency latency_profile() const { return latency_; }
+
+	/// low, normal or safe. Normal for anything else.
+	static Latency latency_by_name(const QString& name);
+
 	void open(const SdlAudioSpec& spec);
 
+	bool is_open() const { return opened_; }
+
+	/// Time till sample written now is heard: queued ring and device
+	/// buffers, which are measured by callback periods
+	time_mark latency() const;
+
+	/// Drops queued audio after seek. Done by callback, it's ring consumer.
+	/// Frames of other serial aren't written anymore.
+	void flush(u64 serial);
+
 	void queue_audio(const SdlAudioChannel& channel, MovieResourcePtr ptr);
 
 	bool write(const SdlAudioChannel& channel, const SdlAudioFrame& frame);
@@ -154,20 +234,72 @@ public:
 
 	const SdlAudioSpec& spec() const { return spec_; }
 
-	void sigwrite();
+	/// Ring is filled enough, producer may rest
+	bool enough_audio() const;
+
+	/// Bytes queued for device
+	size_t buffered() const { return ring_->size(); }
+
+	/// Play time of queued bytes
+	time_mark buffered_time() const;
 
-	bool enough_audio();
+	/// Callbacks which found less data than device asked
+	size_t underruns() const { return ring_->underruns(); }
 
 protected:
 	SdlAudioSpec spec_;
+	Latency latency_;
+	bool opened_;
 
-	bool write_;
+	/// Producer is audio thread, consumer is SDL callback. Callback
+	/// never locks or copies more than it's asked. Made in open().
+	AudioBufferPtr ring_;
 
-	QMutex mutex_;
+	/// Fill level which is enough
+	size_t target_fill_;
+
+	/// Device buffer granted by SDL
+	time_mark device_period_;
+	/// Average interval between callbacks
+	std::atomic<int64_t> measured_period_;
+	std::atomic<int64_t> last_callback_;
+	std::atomic<bool> flush_;
+
+	/// Frame with volume applied, producer side only
+	std::vector<uint8_t> mix_buf_;
+
+	/// Orders write() and flush(), so no stale frame comes after flush
+	QMutex write_mutex_;
+	u64 serial_;
+};
+
+/// Decodes, resamples and mixes audio on its own thread and keeps ring 
+/// of SdlAudio filled, so slow video frames never starve device.
+class SdlAudioProducer : public QThread
+{
+public:
+	SdlAudioProducer(SdlAudio* audio);
+	~SdlAudioProducer();
+
+	void set_source(PreviewState* source, SdlAudioChannel* channel);
+
+	/// Produces while running, sleeps otherwise
+	void set_running(bool running);
 
-	static const size_t audio_buf_sz_ = 4096 * 4;
-	uint8_t audio_buf_[audio_buf_sz_];
-	size_t audio_buf_index_;
+	void stop();
+
+protected:
+	void run() VD_OVERRIDE;
+
+protected:
+	SdlAudio* audio_;
+	PreviewState* source_;
+	SdlAudioChannel* channel_;
+
+	QMutex mutex_;
+	QWaitCondition wake_;
+	bool running_;
+	bool stop_;
 };
 
 class SdlRenderer : public QWidget/*, public Compositor*/ {
@@ -190,6 +322,10 @@ public:
 	SDL_Surface* screen() { return screen_; }
 	SDL_Overlay* overlay() { return overlay_; }
 
+	/// Held around every SDL video call: overlays are created and blitted
+	/// from playback and preroll threads while another one is displayed
+	QMutex* mutex() { return &mutex_; }
+
 protected:
 	
 
@@ -197,6 +333,8 @@ private:
     SDL_Surface* screen_;
 	SDL_Overlay* overlay_;
 	SDL_Overlay* black_screen_;
+
+	QMutex mutex_;
 };
 
 }// namespace vd
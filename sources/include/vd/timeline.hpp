@@ -3,11 +3,16 @@
 
 #include <vd/common.hpp>
 #include <vd/proto.hpp>
+#include <vd/mixer.hpp>
 #include <QObject>
 #include <QScrollBar>
 #include <QGraphicsItem>
 #include <QGraphicsView>
 #include <QGraphicsScene>
+#include <QMutex>
+#include <QThread>
+#include <QWaitCondition>
+#include <map>
 
 namespace vd {
 
@@ -16,6 +21,10 @@ struct StreamConf
 	double time_base;
 };
 
+/// Keeps several decoding states per media, so clips of the same file 
+/// don't share one read position. Open states are limited by count and 
+/// memory: least recently used idle ones are dropped, busy ones are closed 
+/// and reopen themselves when used again.
 class MediaDecoder
 {
 public:
@@ -23,18 +32,61 @@ public:
 
 	virtual ~MediaDecoder() {}
 
-	DecodingStatePtr decode(MediaPtr media);
-	DecodingStatePtr decode(Media* media);
+	/// Idle state positioned nearest before position, least recently used 
+	/// state or new one. State is busy until released. It's subscribed to
+	/// stream_id, if any.
+	DecodingStatePtr acquire(Media* media, time_mark position, int stream_id = -1);
+
+	/// Stream stays subscribed while state is idle, so its read packets
+	/// are there for the next owner
+	void release(DecodingStatePtr state);
+
+	/// Opens state closed by budget, makes room for it
+	void reopen(DecodingStatePtr state);
+
+	bool probe(Media* media, MediaInfo* info);
+
+	void set_budget(size_t max_open, size_t max_bytes);
+
+	/// States which are closer than this to position are taken without seek
+	void set_reuse_window(time_mark window) { reuse_window_ = window; }
 
 	static MediaDecoder& i() { VD_ASSERT2(instance_, "MediaDecoder singleton wasn't created"); return *instance_; }
 
+protected:
+	DecodingStatePtr open(Media* media);
+
+	/// Closes or drops states over budget, never keep. Locks mutex_ 
+	/// itself and doesn't wait for states which are decoding.
+	void enforce_budget(DecodingStatePtr keep);
+
 protected:
 	static MediaDecoder* instance_;
 
-	typedef std::map<AString, DecodingStatePtr> Decoders;
-	typedef std::map<AString, DecodingStatePtr>::iterator DecodersIter;
+	struct Slot
+	{
+		DecodingStatePtr state;
+		bool busy;
+		u64 last_used;
+		/// Subscribed stream of last owner, -1 if none
+		int stream;
+	};
+
+	typedef std::pair<AString, DecodingPolicy> DecoderKey;
+	typedef std::vector<Slot> Pool;
+	typedef std::map<DecoderKey, Pool> Decoders;
+	typedef std::map<DecoderKey, Pool>::iterator DecodersIter;
 
+	/// Guards pools only, files are opened and closed outside of it
+	QMutex mutex_;
+	/// Keyframes of media are built by the first opener
+	QMutex index_mutex_;
 	Decoders decoders_;
+	u64 clock_;
+	time_mark reuse_window_;
+	size_t max_per_media_;
+	size_t max_open_;
+	size_t max_bytes_;
 };
 
 class PreviewState;
@@ -158,6 +210,7 @@ class MediaObject : public TimeLineObject
 {
 public:
 	MediaObject();
+	~MediaObject();
 
 	void setup(MediaClip* clip, int stream_id, PresenterPtr presenter);
 
@@ -171,7 +224,56 @@ public:
 
 	DecodingStatePtr decoder() { return decoder_; }
 
+	/// Takes decoder from MediaDecoder pool, best one for media time position.
+	/// Happens on first seek or show, not in setup.
+	void acquire_decoder(time_mark position);
+
+	/// Gives decoder back to pool when clip isn't played
+	void release_decoder();
+
+	/// Seeks to clip start and fills frames queue ahead of the cut.
+	/// Called from MediaPreroller thread.
+	void preroll();
+
+	bool prerolled() const { return prerolled_; }
+
+	/// Makes clip ready to show from its start when playback enters it.
+	/// Cheap if it has been prerolled already, seeks otherwise.
+	void enter();
+
+	/// Clip goes on from the same media point where prev one is cut,
+	/// like two halves after blade.
+	bool continues(const MediaObject& prev) const;
+
+	/// Takes positioned decoder and buffered frames of prev clip,
+	/// so playback goes on without seek.
+	void take_over(MediaObject* prev);
+
+	/// Returns frame which was shown too early back to queue head
+	void put_back(IFramePtr frame);
+
+	/// Media is decoded till end. Otherwise empty show_next() is a gap,
+	/// frames come again when memory is released.
+	bool finished();
+
+	/// Decodes only keyframe at or before t, fast but not exact
+	void scrub(time_mark t);
+
+	/// Cancels pre-roll of running seek. Called from other thread, 
+	/// doesn't wait for it.
+	void interrupt();
+
 protected:
+	void do_seek(time_mark t);
+
+	/// Target is already decoded: drops frames before it
+	bool seek_in_queue(time_mark target);
+
+	/// Target is a little ahead: decodes till it instead of seeking
+	bool seek_forward(time_mark target);
+
+	void do_release();
+
 	void preload_next();
 
 public:
@@ -188,6 +290,43 @@ public:
 	time_mark read_pts_;
 	DecodingStatePtr decoder_;
 	PresenterPtr presenter_;
+
+	/// Guards queue and decoder between playback and preroll threads
+	QMutex mutex_;
+	/// Guards decoder_ pointer only, it's held shortly
+	QMutex decoder_mutex_;
+	bool prerolled_;
+	/// Decoder gives keyframes only, queue can't be reused for seeking
+	bool scrubbed_;
+};
+
+/// Prepares clips which are going to be played soon, so playback thread
+/// doesn't stall on seek and decoding at clips boundary.
+class MediaPreroller : public QThread
+{
+public:
+	MediaPreroller();
+	~MediaPreroller();
+
+	void schedule(MediaObjectPtr clip);
+
+	/// Drops pending clips and waits for the one in progress. Returns
+	/// clips prerolled since last cancel, they may hold decoders.
+	std::vector<MediaObjectPtr> cancel();
+
+	void stop();
+
+protected:
+	void run() VD_OVERRIDE;
+
+protected:
+	QMutex mutex_;
+	QWaitCondition wake_;
+	QWaitCondition idle_;
+	std::deque<MediaObjectPtr> pending_;
+	MediaObjectPtr current_;
+	std::vector<MediaObjectPtr> done_;
+	bool stop_;
 };
 
 struct PreviewPreset
@@ -207,9 +346,16 @@ public:
 	};
 
 	PreviewState(Project* project);
+	~PreviewState();
 
 	void sync(time_mark t);
 
+	/// Shows keyframe near t on video track, audio is left as is
+	IFramePtr scrub(time_mark t);
+
+	/// Interrupts seek of video clip, called from UI thread
+	void interrupt();
+
 	IFramePtr next_video();
 
 	MovieResourcePtr next_audio();
@@ -218,10 +364,87 @@ public:
 
 	void update_preset(const PreviewPreset& preset);
 
+	Scene* scene() { return scene_; }
+
+	/// How long before clips boundary next clip starts to preroll
+	void set_preroll_ahead(time_mark ahead) { preroll_ahead_ = ahead; }
+
+	/// Output format, tracks are mixed and silence is made in it.
+	/// Set before audio thread starts.
+	void set_audio_format(int freq, int channels);
+
+	/// Timeline time of next mixed audio sample
+	time_mark audio_playing() const;
+
+	/// Same, from other than audio thread. Published once per block.
+	time_mark audio_position() const { return audio_position_; }
+
+	/// Changes on every sync, mixed frames carry it
+	u64 audio_serial();
+
+	/// Media time of video frame to timeline time
+	time_mark video_time(time_mark pts) const;
+
 protected:
+	/// Audio of one track, spliced clip by clip
+	struct AudioTrack
+	{
+		TimeLineTrack* track;
+		MediaObjectPtr clip;
+
+		/// Track position is counted in samples from the last clip switch,
+		/// so boundaries are sample accurate and don't drift
+		time_mark base;
+		int64_t samples;
+
+		/// Frame which mixer block didn't take whole
+		MovieResourcePtr pending;
+		size_t pending_at;
+	};
+
+	/// Schedules preroll of clip which starts after current one
+	void preroll_next(const MediaObjectPtr& current, MediaObjectPtr next);
+
 	MediaObjectPtr peek_video_clip(time_mark t);
 
-	MediaObjectPtr peek_audio_clip(time_mark t);
+	MediaObjectPtr peek_audio_clip(const TimeLineTrack* track, time_mark t);
+
+	/// Start of first clip of track after t, zero when there's none
+	time_mark next_audio_start(const TimeLineTrack* track, time_mark t);
+
+	/// Video clip is read by interrupt() from other thread
+	void set_video_clip(MediaObjectPtr clip);
+
+	/// Scene is read by audio thread too, under audio_mutex_
+	void set_scene(Scene* scene);
+
+	/// Every track of scene but the first one is audio
+	void sync_audio_tracks(time_mark t);
+
+	/// Seek taken from sync() on audio thread, it opens track clips
+	void sync_audio(time_mark t);
+
+	/// Prerolled clips which aren't played after seek give decoders back
+	void release_prerolled();
+
+	/// Timeline time of next sample given out by track
+	time_mark track_playing(const AudioTrack& track) const;
+
+	/// Next spliced frame of track or silence till its next clip
+	MovieResourcePtr next_track_audio(AudioTrack& track);
+
+	/// Switches track to clip from exact timeline time
+	void enter_audio(AudioTrack& track, MediaObjectPtr clip, time_mark t);
+
+	/// Time is at clip start within one output sample, as sample clock
+	/// rounds it down to microseconds
+	bool at_clip_start(time_mark t, const MediaObject& clip) const;
+
+	/// Cuts samples of frame which lay before played position
+	/// or after clip end. False when nothing is left.
+	bool splice(AudioTrack& track, SdlAudioFrame* frame);
+
+	MovieResourcePtr silence(AudioTrack& track, time_mark until);
 
 protected:
 	Project* project_;
@@ -230,22 +453,105 @@ protected:
 	time_mark playing_;
 	PreviewPreset preset_;
 	MediaObjectPtr video_clip_;
-	MediaObjectPtr audio_clip_;
+	QMutex video_mutex_;
+	u64 audio_serial_;
 
 	std::vector<MediaObjectPtr> clips_;
+
+	MediaPreroller* preroller_;
+	time_mark preroll_ahead_;
+
+	/// Audio is mixed on producer thread, seeks come from preview one.
+	/// Lock guards only the request, clips are opened by audio thread.
+	QMutex audio_mutex_;
+	bool audio_sync_;
+	time_mark audio_sync_at_;
+
+	/// Owned by audio thread
+	Scene* audio_scene_;
+	std::vector<AudioTrack> audio_tracks_;
+	AudioMixer mixer_;
+
+	/// Mixed position, counted in samples from the last sync
+	time_mark audio_base_;
+	int64_t audio_samples_;
+	int audio_freq_;
+	int audio_sample_bytes_;
+	/// Track frames and silence are float, see SdlFfmpegAudioDecoder
+	int audio_track_bytes_;
+	std::atomic<time_mark> audio_position_;
+};
+
+/// Warms page cache for file bytes which next seconds of timeline will 
+/// decode. Ranges lay between keyframes around clips ahead of playhead.
+class MediaPrefetcher : public QThread
+{
+public:
+	MediaPrefetcher();
+	~MediaPrefetcher();
+
+	/// Called from preview with playhead of scene. Cheap when playhead moved a little.
+	void update(Scene* scene, time_mark playhead);
+
+	void set_lookahead(time_mark lookahead) { lookahead_ = lookahead; }
+
+	void stop();
+
+protected:
+	/// Media times of clip which will be played soon
+	struct Request
+	{
+		MediaPtr media;
+		time_mark from;
+		time_mark to;
+	};
+
+	struct Range
+	{
+		AString filename;
+		int64_t from;
+		int64_t to;
+	};
+
+	void run() VD_OVERRIDE;
+
+	/// Bytes of media between media times, false when they're unknown.
+	/// May probe media, so runs in worker only.
+	bool byte_range(Media* media, time_mark from, time_mark to, Range* range);
+
+	/// Cuts off part of range which is warmed already. False if nothing left.
+	bool claim(Range* range);
+
+	void warm(const Range& range);
+
+protected:
+	QMutex mutex_;
+	QWaitCondition wake_;
+	std::deque<Request> pending_;
+	/// One warmed byte span per file, playing forward extends it
+	std::map<AString, std::pair<int64_t, int64_t> > warmed_;
+	bool stop_;
+	time_mark lookahead_;
+	time_mark last_playhead_;
+	bool updated_;
 };
 	
 class TimeLineTrack 
 {
 public:
 
-	TimeLineTrack(int track) : track_(track) {}
+	TimeLineTrack(int track) : track_(track), gain_(1.f) {}
 
 	int track() const { return track_; }
 
+	/// Linear gain of track audio in mix
+	void set_gain(float gain) { gain_ = gain; }
+	float gain() const { return gain_; }
+
 protected:
 public:
 	int track_;
+	float gain_;
 
 	typedef std::vector<MediaObjectPtr> MediaClips;
 	typedef std::vector<MediaObjectPtr>::iterator MediaClipsIter;
@@ -434,6 +740,9 @@ public:
 
 	void notify_current_preview_time(time_mark t);
 
+	/// Cursor is dragged: preview shows keyframes only
+	void set_scrubbing(bool scrubbing);
+
 	
 	void set_preview(Preview* preview) { preview_ = preview; }
 
@@ -1,5 +1,19 @@
 /** VD */
 #include <vd/ffmpeg.hpp>
+#include <QFileInfo>
+#include <QDir>
+#include <QDateTime>
+#include <QStandardPaths>
+#include <QCryptographicHash>
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+#ifdef Q_OS_UNIX
+#	include <sys/mman.h>
+#	include <unistd.h>
+#endif
 
 namespace vd {
 
@@ -43,25 +57,122 @@ void log_callback(void *ptr, int level, const char *fmt, va_list vargs)
 	std::cout << "lvl: " << level << std::endl << "msg: " << message << std::endl;
 }
 
+static std::atomic<u64> stream_serials(0);
+
 FfmpegFrame::FfmpegFrame() 
 :	IFrame(nullptr), 
-	frame(nullptr) 
+	frame(nullptr),
+	source(0),
+	serial(0)
 {
 }
 
+time_mark FfmpegFrame::duration() const
+{
+	if (!frame || frame->nb_samples <= 0 || frame->sample_rate <= 0)
+		return 0;
+	return time_mark(frame->nb_samples) * AV_TIME_BASE / frame->sample_rate;
+}
+
 FfmpegFrame::~FfmpegFrame() 
 {
-	/*if (frame)
+	if (frame)
+	{
+		if (pool)
+			pool->release(frame);
+		else
+			av_frame_free(&frame);
+	}
+	frame = nullptr;
+}
+
+//
+// FfmpegFramePool
+//
+FfmpegFramePool::FfmpegFramePool(size_t max_bytes)
+:	used_bytes_(0),
+	max_bytes_(max_bytes)
+{
+}
+
+FfmpegFramePool::~FfmpegFramePool()
+{
+	for (size_t i = 0; i < free_.size(); ++i)
+		av_frame_free(&free_[i]);
+}
+
+size_t FfmpegFramePool::frame_bytes(const AVFrame* frame)
+{
+	size_t bytes = 0;
+	for (size_t i = 0; i < AV_NUM_DATA_POINTERS && frame->buf[i]; ++i)
+		bytes += frame->buf[i]->size;
+	for (int i = 0; i < frame->nb_extended_buf; ++i)
+		bytes += frame->extended_buf[i]->size;
+	return bytes;
+}
+
+AVFrame* FfmpegFramePool::acquire()
+{
+	QMutexLocker lock(&mutex_);
+
+	if (used_bytes_ >= max_bytes_)
+	{
+		VD_ERR("Decoded frames are over memory limit " << max_bytes_);
+		return nullptr;
+	}
+
+	if (free_.empty())
+		return av_frame_alloc();
+
+	AVFrame* frame = free_.back();
+	free_.pop_back();
+	return frame;
+}
+
+void FfmpegFramePool::account(AVFrame* frame)
+{
+	QMutexLocker lock(&mutex_);
+	used_bytes_ += frame_bytes(frame);
+}
+
+void FfmpegFramePool::release(AVFrame* frame)
+{
+	QMutexLocker lock(&mutex_);
+	used_bytes_ -= std::min(used_bytes_, frame_bytes(frame));
+	av_frame_unref(frame);
+	free_.push_back(frame);
+}
+
+void FfmpegFramePool::set_max_bytes(size_t max_bytes)
+{
+	QMutexLocker lock(&mutex_);
+	max_bytes_ = max_bytes;
+}
+
+void FfmpegDecoder::apply_threading(AVCodecContext* codec_ctx, const DecodingPolicy& policy)
+{
+	int threads = policy.threads > 0? policy.threads : QThread::idealThreadCount();
+
+	switch (policy.threading)
 	{
-		av_buffer_unref(frame->buf);
-		av_frame_free(&frame);
+	case DecodingPolicy::TH_SINGLE: threads = 1; codec_ctx->thread_type = 0; break;
+	case DecodingPolicy::TH_SLICE:  codec_ctx->thread_type = FF_THREAD_SLICE; break;
+	case DecodingPolicy::TH_FRAME:  codec_ctx->thread_type = FF_THREAD_FRAME; break;
+	case DecodingPolicy::TH_AUTO:   codec_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE; break;
 	}
-	frame = nullptr;*/
+
+	codec_ctx->thread_count = std::max(threads, 1);
 }
 
-bool FfmpegDecoder::fill_stream_data(FfmpegStream* data, const AVFormatContext* format_ctx, int stream_id)
+bool FfmpegDecoder::fill_stream_data(FfmpegStream* data, const AVFormatContext* format_ctx, int stream_id, const DecodingPolicy& policy)
 {
-	data->stream_id = stream_id;
+	data->stream_id   = stream_id;
+	data->subscribers = 0;
+	data->prerolling  = false;
+	data->preroll_to  = 0;
+	data->finished    = false;
+	data->source      = ++stream_serials;
+	data->serial      = data->source;
 
 	VD_LOG_SCOPE_IDENT();
 	if (format_ctx->streams[stream_id]->codec->codec_type == AVMEDIA_TYPE_VIDEO)
@@ -70,6 +181,7 @@ bool FfmpegDecoder::fill_stream_data(FfmpegStream* data, const AVFormatContext*
 		data->type = FfmpegStream::T_AUDIO;
 
 	data->codec_ctx = format_ctx->streams[stream_id]->codec;
+	data->time_base = data->codec_ctx->time_base;
 
 	data->codec = avcodec_find_decoder(data->codec_ctx->codec_id);
 	//VD_LOG("Finding codec");
@@ -79,6 +191,12 @@ bool FfmpegDecoder::fill_stream_data(FfmpegStream* data, const AVFormatContext*
 	}
 
 	//VD_LOG("Opening codec");
+
+	if (data->type == FfmpegStream::T_VIDEO)
+		apply_threading(data->codec_ctx, policy);
+
+	// Decoded frames own their buffers, so FfmpegFramePool may keep them
+	data->codec_ctx->refcounted_frames = 1;
 	
 	if (avcodec_open2(data->codec_ctx, data->codec, NULL) < 0)
 	{
@@ -89,26 +207,104 @@ bool FfmpegDecoder::fill_stream_data(FfmpegStream* data, const AVFormatContext*
 	return true;
 }
 
-DecodingState* FfmpegDecoder::try_decode(const AString& filename) 
+DecodingState* FfmpegDecoder::try_decode(const AString& filename, const DecodingPolicy& policy) 
+{
+	FfmpegDecodingState* state = new FfmpegDecodingState;
+	if (!open(state, filename, policy))
+	{
+		delete state;
+		return nullptr;
+	}
+	return state;
+}
+
+bool FfmpegDecoder::probe(const AString& filename, MediaInfo* info)
+{
+	FfmpegProbeRecord record;
+	if (FfmpegProbeCache::i().load(filename, &record))
+	{
+		record.fill(info);
+		return true;
+	}
+
+	AVFormatContext* format_ctx = NULL;
+
+	VD_LOG("FFmpegDecoder probing " << filename);
+	if (avformat_open_input(&format_ctx, filename.c_str(), av_find_input_format("mp4"), NULL) < 0) 
+	{
+		VD_LOG("FFmpegDecoder can't open this format");
+		return false;
+	}
+
+	// Header is enough for sizes and rates of most containers, no decoding here
+	for (unsigned int i = 0; i < format_ctx->nb_streams; i++)
+	{
+		const AVCodecContext* ctx = format_ctx->streams[i]->codec;
+		if (ctx->codec_type == AVMEDIA_TYPE_VIDEO && !info->has_video)
+		{
+			info->has_video = true;
+			info->width     = ctx->width;
+			info->height    = ctx->height;
+		}
+		if (ctx->codec_type == AVMEDIA_TYPE_AUDIO && !info->has_audio)
+		{
+			info->has_audio   = true;
+			info->sample_rate = ctx->sample_rate;
+			info->channels    = ctx->channels;
+		}
+	}
+
+	if (format_ctx->duration != AV_NOPTS_VALUE)
+		info->duration = format_ctx->duration;
+
+	info->probed = true;
+	avformat_close_input(&format_ctx);
+	return true;
+}
+
+bool FfmpegDecoder::open(FfmpegDecodingState* state, const AString& filename, const DecodingPolicy& policy) 
 {
 	AVFormatContext* format_ctx = NULL;
 	int err;
 
 	AVInputFormat* fmt = av_find_input_format("mp4");
 	VD_LOG("FFmpegDecoder trying to open " << filename);
+
+	std::unique_ptr<FfmpegMappedIo> io;
+	if (policy.mapped_io)
+	{
+		io.reset(new FfmpegMappedIo);
+		if (io->open(filename))
+		{
+			format_ctx = avformat_alloc_context();
+			format_ctx->pb = io->context();
+		}
+		else
+			io.reset(); // Not local or too big for address space
+	}
+
 	err = avformat_open_input(&format_ctx, filename.c_str(), fmt, NULL);
 
 	VD_LOG_SCOPE_IDENT();
 	if (err < 0) 
 	{
 		VD_LOG("FFmpegDecoder can't open this format");
-		return nullptr;
+		return false;
     }
 
-	if ((err = av_find_stream_info(format_ctx)) < 0)
+	// Full probe reads and decodes seconds of file, do it once per file version
+	FfmpegProbeRecord record;
+	if (!FfmpegProbeCache::i().load(filename, &record) || !record.apply(format_ctx))
 	{
-		VD_LOG("FFmpegDecoder can't find stream info");
-		return nullptr;
+		if ((err = av_find_stream_info(format_ctx)) < 0)
+		{
+			VD_LOG("FFmpegDecoder can't find stream info");
+			avformat_close_input(&format_ctx);
+			return false;
+		}
+
+		record.fill(format_ctx);
+		FfmpegProbeCache::i().store(filename, record);
 	}
 
 	// Find the first video stream
@@ -118,12 +314,17 @@ DecodingState* FfmpegDecoder::try_decode(const AString& filename)
 	int audio_streams = 0;
 	int ok = 1;
 	VD_LOG(format_ctx->nb_streams << " streams found");
+
+	// Nothing is read until MediaObject subscribes
+	for (unsigned int i = 0; i < format_ctx->nb_streams; i++)
+		format_ctx->streams[i]->discard = AVDISCARD_ALL;
+
 	for (unsigned int i = 0; i < format_ctx->nb_streams; i++)
 	{
 		VD_LOG_SCOPE_IDENT();
 		if (format_ctx->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO) 
 		{
-			ok = fill_stream_data(&stream, format_ctx, i);
+			ok = fill_stream_data(&stream, format_ctx, i, policy);
 			streams.push_back(stream);
 			++video_streams;
 		}
@@ -133,87 +334,389 @@ DecodingState* FfmpegDecoder::try_decode(const AString& filename)
 		VD_LOG_SCOPE_IDENT();
 		if (format_ctx->streams[i]->codec->codec_type == AVMEDIA_TYPE_AUDIO)
 		{
-			ok = fill_stream_data(&stream, format_ctx, i);
+			ok = fill_stream_data(&stream, format_ctx, i, policy);
 			streams.push_back(stream);
 			++audio_streams;
 		}
 	}
 
-	FfmpegDecodingState* state = new FfmpegDecodingState;
 	state->format_ctx_ = format_ctx;
+	state->io_         = std::move(io);
 	state->streams_    = streams;
+	state->filename_   = filename;
+	state->policy_     = policy;
+	if (!streams.empty())
+	{
+		state->width_  = streams[0].codec_ctx->width;
+		state->height_ = streams[0].codec_ctx->height;
+	}
+	state->start_demuxer();
 
 	VD_ASSERT2(video_streams == 1, "Expected only one video stream");
 	VD_ASSERT2(audio_streams <= 1, "Expected only one audio stream");
 
-	return state;
+	return true;
 }
 
 FfmpegDecodingState::FfmpegDecodingState()
 :	format_ctx_(nullptr),
 	conv_ctx_(nullptr),
-	offset_(0)
+	offset_(0),
+	frames_(std::make_shared<FfmpegFramePool>(256 * 1024 * 1024)),
+	preroll_(0),
+	position_(0),
+	used_at_(0),
+	width_(0),
+	height_(0),
+	key_only_(false),
+	interrupted_(false),
+	open_(false),
+	memory_(0)
 {
 }
 
-time_mark FfmpegDecodingState::time_base(size_t stream_id) const
+FfmpegDecodingState::~FfmpegDecodingState()
 {
-	return time_mark(av_q2d(streams_[stream_id].codec_ctx->time_base) * AV_TIME_BASE);
+	release();
 }
 
-bool FfmpegDecodingState::read()
+void FfmpegDecodingState::release()
 {
-	int end = 1;
-	int packets_read = 0;
+	open_   = false;
+	memory_ = 0;
+	demuxer_.reset();
+	prev_frame_ = nullptr;
+	// New codecs decode everything
+	key_only_ = false;
 
-	AVPacket packet;
-	av_init_packet(&packet);
+	for (size_t i = 0; i < streams_.size(); ++i)
+	{
+		if (streams_[i].codec_ctx)
+			avcodec_close(streams_[i].codec_ctx);
+		streams_[i].codec_ctx = nullptr;
+		streams_[i].codec     = nullptr;
+	}
+
+	if (format_ctx_)
+		avformat_close_input(&format_ctx_);
+
+	io_.reset();
+}
+
+bool FfmpegDecodingState::open()
+{
+	QMutexLocker lock(&mutex_);
+	return ensure_open();
+}
+
+void FfmpegDecodingState::close()
+{
+	QMutexLocker lock(&mutex_);
+	if (!format_ctx_)
+		return;
+
+	VD_LOG("Closing decoder of " << filename_ << " at " << position_);
+	release();
+}
+
+bool FfmpegDecodingState::is_open() const
+{
+	return open_;
+}
 
-	while (packets_read < 10 && (end = av_read_frame(format_ctx_, &packet)) >= 0) 
+bool FfmpegDecodingState::try_close()
+{
+	if (!mutex_.tryLock())
+		return false;
+
+	if (format_ctx_)
 	{
-		for (size_t i = 0; i < streams_.size(); ++i)
-		{
-			FfmpegStream& stream = streams_[i];
-			if (packet.stream_index == stream.stream_id) 
-			{
-				AVPacket copy;
-				av_copy_packet(&copy, &packet);
-				stream.pool.push_back(copy);
-				++packets_read;
-			}
-		}
-		av_free_packet(&packet);
+		VD_LOG("Closing decoder of " << filename_ << " at " << position_);
+		release();
+	}
+	mutex_.unlock();
+	return true;
+}
+
+bool FfmpegDecodingState::ensure_open()
+{
+	if (format_ctx_)
+		return true;
+
+	std::vector<int> subscribers;
+	for (size_t i = 0; i < streams_.size(); ++i)
+		subscribers.push_back(streams_[i].subscribers);
+
+	VD_LOG("Reopening decoder of " << filename_ << " at " << position_);
+	FfmpegDecoder decoder;
+	if (!decoder.open(this, filename_, policy_))
+		return false;
+
+	for (size_t i = 0; i < subscribers.size() && i < streams_.size(); ++i)
+	{
+		if (subscribers[i] > 0)
+			demuxer_->subscribe(i, subscribers[i]);
+	}
+
+	// Continue right after the last returned frame
+	do_seek(position_ + 1);
+	return true;
+}
+
+void FfmpegDecodingState::update_memory()
+{
+	if (!format_ctx_)
+	{
+		memory_ = 0;
+		return;
+	}
+
+	size_t bytes = demuxer_->queued_bytes() + frames_->used_bytes();
+
+	// Reference frames and frames in flight of threads live inside codec
+	for (size_t i = 0; i < streams_.size(); ++i)
+	{
+		const AVCodecContext* ctx = streams_[i].codec_ctx;
+		if (streams_[i].type == FfmpegStream::T_VIDEO)
+			bytes += size_t(ctx->width) * ctx->height * 3 / 2 * (std::max(ctx->refs, 1) + ctx->thread_count);
+	}
+
+	memory_ = bytes;
+}
+
+void FfmpegDecodingState::subscribe(size_t stream_id)
+{
+	QMutexLocker lock(&mutex_);
+	if (!format_ctx_)
+	{
+		// Counted now, applied when reopened
+		++streams_[stream_id].subscribers;
+		return;
+	}
+	demuxer_->subscribe(stream_id, 1);
+}
+
+void FfmpegDecodingState::unsubscribe(size_t stream_id)
+{
+	QMutexLocker lock(&mutex_);
+	if (!format_ctx_)
+	{
+		streams_[stream_id].subscribers = std::max(streams_[stream_id].subscribers - 1, 0);
+		return;
 	}
+	demuxer_->subscribe(stream_id, -1);
+}
+
+void FfmpegDecodingState::set_frame_memory_limit(size_t bytes)
+{
+	frames_->set_max_bytes(bytes);
+}
+
+void FfmpegDecodingState::start_demuxer()
+{
+	demuxer_.reset(new FfmpegDemuxer(this));
+	demuxer_->start();
+	open_ = true;
+	update_memory();
+}
 
-	return end >= 0;
+time_mark FfmpegDecodingState::time_base(size_t stream_id) const
+{
+	return time_mark(av_q2d(streams_[stream_id].time_base) * AV_TIME_BASE);
 }
 
 void FfmpegDecodingState::seek(time_mark seek_target)
 {
-	AVRational q = {1, AV_TIME_BASE};
-	seek_target = av_rescale_q((uint64_t)seek_target, q, format_ctx_->streams[0]->time_base);
-	if (av_seek_frame(format_ctx_, 0, (uint64_t)seek_target, AVSEEK_FLAG_FRAME) < 0)
+	QMutexLocker lock(&mutex_);
+	used_at_ = av_gettime();
+	interrupted_ = false;
+
+	if (!format_ctx_)
+	{
+		// Will land here when reopened
+		position_ = seek_target > 0? seek_target - 1 : 0;
+		return;
+	}
+
+	set_key_only(false);
+	do_seek(seek_target);
+}
+
+void FfmpegDecodingState::seek_key(time_mark seek_target)
+{
+	QMutexLocker lock(&mutex_);
+	used_at_ = av_gettime();
+	interrupted_ = false;
+
+	const KeyframeIndex::Entry* key = keyframes_? keyframes_->find(seek_target) : nullptr;
+	if (key)
+		seek_target = key->pts;
+
+	if (!ensure_open())
+		return;
+
+	do_seek(seek_target);
+	set_key_only(true);
+
+	// Whatever keyframe comes first is shown
+	for (size_t i = 0; i < streams_.size(); ++i)
+	{
+		if (streams_[i].type == FfmpegStream::T_VIDEO)
+			streams_[i].prerolling = false;
+	}
+	preroll_ = 0;
+}
+
+void FfmpegDecodingState::set_key_only(bool key_only)
+{
+	if (key_only_ == key_only)
+		return;
+
+	key_only_ = key_only;
+	for (size_t i = 0; i < streams_.size(); ++i)
+	{
+		if (streams_[i].type != FfmpegStream::T_VIDEO)
+			continue;
+
+		AVCodecContext* ctx = streams_[i].codec_ctx;
+		ctx->skip_frame       = key_only? AVDISCARD_NONKEY : AVDISCARD_DEFAULT;
+		ctx->skip_loop_filter = key_only? AVDISCARD_ALL : AVDISCARD_DEFAULT;
+	}
+}
+
+void FfmpegDecodingState::do_seek(time_mark seek_target)
+{
+	const FfmpegStream& video = streams_[0];
+	const KeyframeIndex::Entry* key = keyframes_? keyframes_->find(seek_target) : nullptr;
+
+	for (size_t i = 0; i < streams_.size(); ++i)
+	{
+		streams_[i].prerolling = true;
+		streams_[i].preroll_to = seek_target;
+		streams_[i].finished   = false;
+	}
+	position_ = seek_target;
+
+	bool ok;
+	if (key)
+	{
+		// Land exactly on keyframe, decoder knows how far the target is
+		preroll_ = keyframes_->preroll(*key, seek_target);
+		ok = demuxer_->seek(video.stream_id, key->timestamp, AVSEEK_FLAG_BACKWARD);
+	}
+	else
+	{
+		AVRational q = {1, AV_TIME_BASE};
+		preroll_ = 0;
+		seek_target = av_rescale_q((uint64_t)seek_target, q, format_ctx_->streams[video.stream_id]->time_base);
+		ok = demuxer_->seek(video.stream_id, (uint64_t)seek_target, AVSEEK_FLAG_FRAME);
+	}
+
+	if (!ok)
 	{
 		VD_ERR("Error in seeking");
 	}
 
-	flush_pools();
+	for (size_t i = 0; i < streams_.size(); ++i)
+	{
+		avcodec_flush_buffers(streams_[i].codec_ctx);
+		streams_[i].serial = ++stream_serials;
+	}
 
 	offset_ = 0;
 	prev_frame_ = nullptr;
 }
 
-void FfmpegDecodingState::flush_pools()
+bool FfmpegDecodingState::build_keyframes(KeyframeIndex* keyframes)
 {
-	for (size_t i = 0; i < streams_.size(); ++i)
+	const FfmpegStream& video = streams_[0];
+	const AVStream* stream = format_ctx_->streams[video.stream_id];
+	AVRational q = {1, AV_TIME_BASE};
+
+	if (stream->avg_frame_rate.num > 0)
+		keyframes->set_frame_duration(av_rescale_q(1, av_inv_q(stream->avg_frame_rate), q));
+
+	// Containers like mp4 keep every sample in header, timestamps there are
+	// DTS. Keyframe is shown at most reorder delay later, so pts is taken
+	// from above: find() may pick one keyframe earlier, never a late one.
+	time_mark reorder = video.codec_ctx->has_b_frames * keyframes->frame_duration();
+
+	std::vector<KeyframeIndex::Entry> entries;
+	for (int i = 0; i < stream->nb_index_entries; ++i)
 	{
-		FfmpegStream& stream = streams_[i];
+		const AVIndexEntry& ie = stream->index_entries[i];
+		if (ie.flags & AVINDEX_KEYFRAME)
+		{
+			KeyframeIndex::Entry entry;
+			entry.pts       = av_rescale_q(ie.timestamp, stream->time_base, q) + reorder;
+			entry.timestamp = ie.timestamp;
+			entry.pos       = ie.pos;
+			entry.gop       = 0;
+			entries.push_back(entry);
+		}
 
-		for (size_t j = 0; j < stream.pool.size(); ++j)
-			av_free_packet(&stream.pool[j]);
+		if (!entries.empty())
+			++entries.back().gop;
+	}
 
-		streams_[i].pool.clear();
+	if (entries.empty())
+		return scan_keyframes(keyframes);
+
+	for (size_t i = 0; i < entries.size(); ++i)
+		keyframes->add(entries[i]);
+
+	VD_LOG(keyframes->size() << " keyframes indexed in " << filename_);
+	return true;
+}
+
+bool FfmpegDecodingState::scan_keyframes(KeyframeIndex* keyframes)
+{
+	AVFormatContext* format_ctx = NULL;
+	if (avformat_open_input(&format_ctx, filename_.c_str(), NULL, NULL) < 0)
+	{
+		VD_ERR("Can't open " << filename_ << " for keyframes scan");
+		return false;
+	}
+
+	int video_id = streams_[0].stream_id;
+	for (unsigned int i = 0; i < format_ctx->nb_streams; ++i)
+		format_ctx->streams[i]->discard = int(i) == video_id? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+
+	const AVStream* stream = format_ctx->streams[video_id];
+	AVRational q = {1, AV_TIME_BASE};
+
+	// Packets come in decoding order, gop is counted till the next keyframe
+	std::vector<KeyframeIndex::Entry> entries;
+	AVPacket packet;
+	av_init_packet(&packet);
+	while (av_read_frame(format_ctx, &packet) >= 0)
+	{
+		if (packet.stream_index == video_id)
+		{
+			int64_t ts = packet.pts != AV_NOPTS_VALUE? packet.pts : packet.dts;
+			if ((packet.flags & AV_PKT_FLAG_KEY) && ts != AV_NOPTS_VALUE)
+			{
+				KeyframeIndex::Entry entry;
+				entry.pts       = av_rescale_q(ts, stream->time_base, q);
+				entry.timestamp = ts;
+				entry.pos       = packet.pos;
+				entry.gop       = 0;
+				entries.push_back(entry);
+			}
+
+			if (!entries.empty())
+				++entries.back().gop;
+		}
+		av_free_packet(&packet);
 	}
+
+	avformat_close_input(&format_ctx);
+
+	for (size_t i = 0; i < entries.size(); ++i)
+		keyframes->add(entries[i]);
+
+	VD_LOG(keyframes->size() << " keyframes scanned in " << filename_);
+	return !keyframes->empty();
 }
 
 time_mark FfmpegDecodingState::length() const
@@ -223,76 +726,162 @@ time_mark FfmpegDecodingState::length() const
 
 int FfmpegDecodingState::width() const
 {
-	return streams_[0].codec_ctx->width;
+	return width_;
 }
 
 int FfmpegDecodingState::height() const
 {
-	return streams_[0].codec_ctx->height;
+	return height_;
+}
+
+bool FfmpegDecodingState::finished(size_t stream_id) const
+{
+	QMutexLocker lock(&mutex_);
+	return streams_[stream_id].finished;
+}
+
+time_mark FfmpegDecodingState::frame_time(const FfmpegStream& stream, AVFrame* frame) const
+{
+	AVRational q = {1, AV_TIME_BASE};
+	int64_t ts = av_frame_get_best_effort_timestamp(frame);
+	if (ts == AV_NOPTS_VALUE)
+		return 0;
+	return av_rescale_q(ts, format_ctx_->streams[stream.stream_id]->time_base, q);
+}
+
+time_mark FfmpegDecodingState::packet_time(const FfmpegStream& stream, const AVPacket& packet) const
+{
+	AVRational q = {1, AV_TIME_BASE};
+	int64_t ts = packet.pts != AV_NOPTS_VALUE? packet.pts : packet.dts;
+	if (ts == AV_NOPTS_VALUE)
+		return 0;
+	return av_rescale_q(ts, format_ctx_->streams[stream.stream_id]->time_base, q);
 }
 
 IFramePtr FfmpegDecodingState::peek_frame(size_t stream_id)
 {
+	QMutexLocker lock(&mutex_);
+	used_at_ = av_gettime();
+
+	if (!ensure_open())
+		return IFramePtr(nullptr);
+
 	int frame_finished = 0;
 	int result = 1;
-	int have_smth = 1;
 
-	AVFrame* frame = avcodec_alloc_frame();
+	AVFrame* frame = frames_->acquire();
+	if (!frame)
+		return IFramePtr(nullptr);
+
 	FfmpegStream& stream = streams_[stream_id];
 	size_t data_sz = 0;
 
-	while (have_smth)
-	{
-		while (have_smth && stream.pool.empty())
-			have_smth = read();
-		if (stream.pool.empty()) // No more frames. Stream finished.
-			break;
-
-		AVPacket& packet = stream.pool.front();
+	AVPacket packet;
+	time_mark pts = 0;
 
-		if (stream.type == FfmpegStream::T_VIDEO) 
-		{
-			avcodec_decode_video2(stream.codec_ctx, frame, &frame_finished, &packet);
-		}
+	while (true)
+	{
+		frame_finished = 0;
 
-		if (stream.type == FfmpegStream::T_AUDIO) 
+		while (demuxer_->pop(stream_id, &packet)) // Nothing popped: stream finished.
 		{
-			int sz = packet.size;
-			int read = avcodec_decode_audio4(stream.codec_ctx, frame, &frame_finished, &packet);
-			data_sz += read;
-
-			AVRational tb = {1, frame->sample_rate};
-			if (frame->pts != AV_NOPTS_VALUE)
-				frame->pts = av_rescale_q(frame->pts, stream.codec_ctx->time_base, tb);
-			if (frame->pts == AV_NOPTS_VALUE && packet.pts != AV_NOPTS_VALUE)
-				frame->pts = av_rescale_q(packet.pts, stream.codec_ctx->time_base, tb);
-			if (packet.pts != AV_NOPTS_VALUE)
-				packet.pts += (double) frame->nb_samples / frame->sample_rate / av_q2d(stream.codec_ctx->time_base);
-
-			if (read != sz)
+			if (stream.type == FfmpegStream::T_VIDEO) 
 			{
-				VD_ERR("Unhandled multuply audio data in codec! We were warned:(.");
+				// Nobody refers non-reference frames, those before target are never seen
+				if (stream.prerolling)
+				{
+					bool before = packet_time(stream, packet) < stream.preroll_to;
+					stream.codec_ctx->skip_frame = before? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+				}
+
+				avcodec_decode_video2(stream.codec_ctx, frame, &frame_finished, &packet);
 			}
-			//memcpy(stream, ff_frame->frame->data[0], data_size);
 
-			if (stream.codec->capabilities & CODEC_CAP_DELAY)
+			if (stream.type == FfmpegStream::T_AUDIO) 
 			{
-				VD_ERR("CODEC_CAP_DELAY.");
+				int sz = packet.size;
+				int read = avcodec_decode_audio4(stream.codec_ctx, frame, &frame_finished, &packet);
+				data_sz += read;
+
+				if (read != sz)
+				{
+					VD_ERR("Unhandled multuply audio data in codec! We were warned:(.");
+				}
+				//memcpy(stream, ff_frame->frame->data[0], data_size);
+
+				if (stream.codec->capabilities & CODEC_CAP_DELAY)
+				{
+					VD_ERR("CODEC_CAP_DELAY.");
+				}
 			}
+
+			av_free_packet(&packet);
+
+			if (frame_finished)
+				break;
 		}
 
-		av_free_packet(&packet);
-		stream.pool.pop_front();
+		// Frame threads hold last frames until empty packets drain them
+		if (!frame_finished && stream.type == FfmpegStream::T_VIDEO && (stream.codec->capabilities & CODEC_CAP_DELAY))
+		{
+			av_init_packet(&packet);
+			packet.data = nullptr;
+			packet.size = 0;
+			avcodec_decode_video2(stream.codec_ctx, frame, &frame_finished, &packet);
+		}
+
+		if (!frame_finished)
+		{
+			stream.finished = true;
+			frames_->release(frame);
+			update_memory();
+			return IFramePtr(nullptr);
+		}
+
+		pts = frame_time(stream, frame);
+		if (!stream.prerolling || pts >= stream.preroll_to)
+			break;
 
-		if (frame_finished)
+		// Audio frame over target is kept, splice trims its head
+		if (stream.type == FfmpegStream::T_AUDIO && frame->sample_rate > 0
+			&& pts + time_mark(frame->nb_samples) * AV_TIME_BASE / frame->sample_rate > stream.preroll_to)
 			break;
+
+		// Frame without timestamp can't be compared, index tells how many to drop
+		bool timed = av_frame_get_best_effort_timestamp(frame) != AV_NOPTS_VALUE;
+		if (stream.type == FfmpegStream::T_VIDEO)
+		{
+			if (!timed && preroll_ == 0)
+				break;
+			if (preroll_ > 0)
+				--preroll_;
+		}
+
+		// Pre-roll frame: no conversion, nobody sees it
+		av_frame_unref(frame);
+		data_sz = 0;
+
+		// Target isn't wanted anymore. Still prerolling, next peek goes on.
+		if (interrupted_.exchange(false))
+		{
+			frames_->release(frame);
+			return IFramePtr(nullptr);
+		}
 	}
 
-	if (!frame_finished)
-		return IFramePtr(nullptr);
+	if (stream.prerolling)
+	{
+		if (stream.type == FfmpegStream::T_VIDEO)
+			preroll_ = 0;
+		stream.prerolling = false;
+		stream.codec_ctx->skip_frame = AVDISCARD_DEFAULT;
+	}
+
+	frames_->account(frame);
+	position_ = pts;
 
 	time_mark base = time_mark(av_q2d(stream.codec_ctx->time_base) * AV_TIME_BASE);
-	time_mark pts  = frame->pts * base - offset_;
+	pts -= offset_;
 
 	if (prev_frame_ && stream_id == 0)
 	{
@@ -308,9 +897,544 @@ IFramePtr FfmpegDecodingState::peek_frame(size_t stream_id)
 	ff_frame->frame     = frame;
 	ff_frame->codec_ctx = stream.codec_ctx;
 	ff_frame->data_sz   = data_sz;
+	ff_frame->source    = stream.source;
+	ff_frame->serial    = stream.serial;
+	ff_frame->pool      = frames_;
 	ff_frame->set_pts(pts);
 	prev_frame_ = IFramePtr(ff_frame);
+	update_memory();
 	return prev_frame_;
 }
 
+//
+// FfmpegMappedIo
+//
+static const int mapped_io_buffer_sz = 64 * 1024;
+static const int64_t mapped_io_readahead = 8 * 1024 * 1024;
+
+FfmpegMappedIo::FfmpegMappedIo()
+:	data_(nullptr),
+	size_(0),
+	pos_(0),
+	advised_from_(0),
+	advised_to_(0),
+	io_ctx_(nullptr)
+{
+}
+
+FfmpegMappedIo::~FfmpegMappedIo()
+{
+	if (io_ctx_)
+	{
+		av_freep(&io_ctx_->buffer); // Could be reallocated by libavformat
+		av_freep(&io_ctx_);
+	}
+
+	if (data_)
+		file_.unmap(data_);
+}
+
+bool FfmpegMappedIo::open(const AString& filename)
+{
+	file_.setFileName(QString::fromStdString(filename));
+	if (!file_.open(QIODevice::ReadOnly))
+		return false;
+
+	size_ = file_.size();
+	data_ = file_.map(0, size_);
+	if (!data_)
+	{
+		VD_LOG("Can't map " << filename << ", using file protocol");
+		return false;
+	}
+
+	unsigned char* buffer = (unsigned char*) av_malloc(mapped_io_buffer_sz);
+	io_ctx_ = avio_alloc_context(buffer, mapped_io_buffer_sz, 0, this, 
+		&FfmpegMappedIo::read_packet, NULL, &FfmpegMappedIo::seek);
+
+	advise();
+	return io_ctx_ != nullptr;
+}
+
+int FfmpegMappedIo::read_packet(void* opaque, uint8_t* buf, int size)
+{
+	FfmpegMappedIo* io = reinterpret_cast<FfmpegMappedIo*>(opaque);
+	if (io->pos_ >= io->size_)
+		return AVERROR_EOF;
+
+	int n = (int) std::min<int64_t>(size, io->size_ - io->pos_);
+	memcpy(buf, io->data_ + io->pos_, n);
+	io->pos_ += n;
+	io->advise();
+	return n;
+}
+
+int64_t FfmpegMappedIo::seek(void* opaque, int64_t offset, int whence)
+{
+	FfmpegMappedIo* io = reinterpret_cast<FfmpegMappedIo*>(opaque);
+
+	int64_t pos;
+	switch (whence & ~AVSEEK_FORCE)
+	{
+	case AVSEEK_SIZE: return io->size_;
+	case SEEK_SET: pos = offset; break;
+	case SEEK_CUR: pos = io->pos_ + offset; break;
+	case SEEK_END: pos = io->size_ + offset; break;
+	default: return -1;
+	}
+
+	if (pos < 0 || pos > io->size_)
+		return -1;
+
+	io->pos_ = pos;
+	io->advise();
+	return pos;
+}
+
+void FfmpegMappedIo::advise()
+{
+	// Inside window and far from its end: kernel is already reading
+	if (pos_ >= advised_from_ && pos_ + mapped_io_readahead / 2 < advised_to_)
+		return;
+
+	advised_from_ = pos_;
+	advised_to_   = std::min(pos_ + mapped_io_readahead, size_);
+
+#ifdef Q_OS_UNIX
+	static const int64_t page = sysconf(_SC_PAGESIZE);
+	int64_t from = advised_from_ / page * page;
+	if (advised_to_ > from)
+		madvise(data_ + from, size_t(advised_to_ - from), MADV_WILLNEED);
+#endif
+}
+
+//
+// FfmpegProbeRecord
+//
+void FfmpegProbeRecord::fill(const AVFormatContext* format_ctx)
+{
+	duration = format_ctx->duration;
+
+	streams.clear();
+	for (unsigned int i = 0; i < format_ctx->nb_streams; ++i)
+	{
+		const AVStream* st = format_ctx->streams[i];
+		const AVCodecContext* ctx = st->codec;
+
+		Stream s;
+		s.codec_type     = ctx->codec_type;
+		s.codec_id       = ctx->codec_id;
+		s.width          = ctx->width;
+		s.height         = ctx->height;
+		s.pix_fmt        = ctx->pix_fmt;
+		s.sample_rate    = ctx->sample_rate;
+		s.channels       = ctx->channels;
+		s.sample_fmt     = ctx->sample_fmt;
+		s.channel_layout = ctx->channel_layout;
+		s.frame_rate_num = st->avg_frame_rate.num;
+		s.frame_rate_den = st->avg_frame_rate.den;
+		s.duration       = st->duration;
+		s.has_b_frames   = ctx->has_b_frames;
+		s.time_base_num  = ctx->time_base.num;
+		s.time_base_den  = ctx->time_base.den;
+		streams.push_back(s);
+	}
+}
+
+bool FfmpegProbeRecord::apply(AVFormatContext* format_ctx) const
+{
+	if (streams.size() != format_ctx->nb_streams)
+		return false;
+
+	for (unsigned int i = 0; i < format_ctx->nb_streams; ++i)
+	{
+		if (streams[i].codec_id != format_ctx->streams[i]->codec->codec_id)
+			return false;
+	}
+
+	for (unsigned int i = 0; i < format_ctx->nb_streams; ++i)
+	{
+		AVStream* st = format_ctx->streams[i];
+		AVCodecContext* ctx = st->codec;
+		const Stream& s = streams[i];
+
+		ctx->width          = s.width;
+		ctx->height         = s.height;
+		ctx->pix_fmt        = (AVPixelFormat) s.pix_fmt;
+		ctx->sample_rate    = s.sample_rate;
+		ctx->channels       = s.channels;
+		ctx->sample_fmt     = (AVSampleFormat) s.sample_fmt;
+		ctx->channel_layout = s.channel_layout;
+		st->avg_frame_rate.num = s.frame_rate_num;
+		st->avg_frame_rate.den = s.frame_rate_den;
+		st->duration        = s.duration;
+		ctx->has_b_frames   = s.has_b_frames;
+		ctx->time_base.num  = s.time_base_num;
+		ctx->time_base.den  = s.time_base_den;
+	}
+
+	format_ctx->duration = duration;
+	return true;
+}
+
+void FfmpegProbeRecord::fill(MediaInfo* info) const
+{
+	for (size_t i = 0; i < streams.size(); ++i)
+	{
+		const Stream& s = streams[i];
+		if (s.codec_type == AVMEDIA_TYPE_VIDEO && !info->has_video)
+		{
+			info->has_video = true;
+			info->width     = s.width;
+			info->height    = s.height;
+		}
+		if (s.codec_type == AVMEDIA_TYPE_AUDIO && !info->has_audio)
+		{
+			info->has_audio   = true;
+			info->sample_rate = s.sample_rate;
+			info->channels    = s.channels;
+		}
+	}
+
+	if (duration != AV_NOPTS_VALUE)
+		info->duration = duration;
+	info->probed = true;
+}
+
+//
+// FfmpegProbeCache
+//
+FfmpegProbeCache* FfmpegProbeCache::instance_ = nullptr;
+
+static const u64 probe_record_magic = 0x3230424f52504456ull; // "VDPROB02"
+
+FfmpegProbeCache::FfmpegProbeCache()
+{
+	VD_ASSERT2(!instance_, "FfmpegProbeCache must have only instance!");
+	instance_ = this;
+
+	QString dir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/probe";
+	QDir().mkpath(dir);
+	dir_ = dir.toStdString();
+}
+
+FfmpegProbeCache::~FfmpegProbeCache()
+{
+	instance_ = nullptr;
+}
+
+bool FfmpegProbeCache::identity(const AString& filename, int64_t* size, int64_t* mtime)
+{
+	QFileInfo info(QString::fromStdString(filename));
+	if (!info.exists())
+		return false;
+
+	*size  = info.size();
+	*mtime = info.lastModified().toMSecsSinceEpoch();
+	return true;
+}
+
+AString FfmpegProbeCache::record_path(const AString& filename) const
+{
+	QString path = QFileInfo(QString::fromStdString(filename)).absoluteFilePath();
+	QByteArray hash = QCryptographicHash::hash(path.toUtf8(), QCryptographicHash::Md5).toHex();
+	return dir_ + "/" + hash.constData() + ".probe";
+}
+
+bool FfmpegProbeCache::load(const AString& filename, FfmpegProbeRecord* record)
+{
+	int64_t size, mtime;
+	if (!identity(filename, &size, &mtime))
+		return false;
+
+	QMutexLocker lock(&mutex_);
+
+	std::map<AString, FfmpegProbeRecord>::iterator found = records_.find(filename);
+	if (found != records_.end() && found->second.file_size == size && found->second.file_mtime == mtime)
+	{
+		*record = found->second;
+		return true;
+	}
+
+	FILE* f = fopen(record_path(filename).c_str(), "rb");
+	if (!f)
+		return false;
+
+	u64 magic = 0;
+	bike::ArchiveReader rd(f);
+	bike::arch_simple(magic, rd);
+	if (magic == probe_record_magic)
+		archive(*record, rd);
+	bool ok = magic == probe_record_magic && !ferror(f) && !feof(f);
+	fclose(f);
+
+	if (!ok || record->file_size != size || record->file_mtime != mtime)
+		return false;
+
+	records_[filename] = *record;
+	return true;
+}
+
+void FfmpegProbeCache::store(const AString& filename, FfmpegProbeRecord record)
+{
+	if (!identity(filename, &record.file_size, &record.file_mtime))
+		return;
+
+	QMutexLocker lock(&mutex_);
+	records_[filename] = record;
+
+	FILE* f = fopen(record_path(filename).c_str(), "wb");
+	if (!f)
+	{
+		VD_ERR("Can't write probe record of " << filename);
+		return;
+	}
+
+	u64 magic = probe_record_magic;
+	bike::ArchiveWriter wt(f);
+	bike::arch_simple(magic, wt);
+	archive(record, wt);
+	fclose(f);
+}
+
+//
+// FfmpegDemuxer
+//
+FfmpegDemuxer::FfmpegDemuxer(FfmpegDecodingState* state)
+:	state_(state),
+	stop_(false),
+	eof_(false),
+	generation_(0),
+	starving_(0),
+	max_packets_(256),
+	max_bytes_(16 * 1024 * 1024)
+{
+}
+
+FfmpegDemuxer::~FfmpegDemuxer()
+{
+	stop();
+	wait();
+	flush_pools();
+
+	for (size_t i = 0; i < shells_.size(); ++i)
+		delete shells_[i];
+}
+
+AVPacket* FfmpegDemuxer::take_shell()
+{
+	AVPacket* shell;
+	if (shells_.empty())
+		shell = new AVPacket;
+	else
+	{
+		shell = shells_.back();
+		shells_.pop_back();
+	}
+
+	av_init_packet(shell);
+	shell->data = nullptr;
+	shell->size = 0;
+	return shell;
+}
+
+void FfmpegDemuxer::give_shell(AVPacket* shell)
+{
+	shells_.push_back(shell);
+}
+
+void FfmpegDemuxer::set_limits(size_t max_packets, size_t max_bytes)
+{
+	QMutexLocker lock(&mutex_);
+	max_packets_ = max_packets;
+	max_bytes_   = max_bytes;
+	writable_.wakeAll();
+}
+
+void FfmpegDemuxer::stop()
+{
+	QMutexLocker lock(&mutex_);
+	stop_ = true;
+	readable_.wakeAll();
+	writable_.wakeAll();
+}
+
+bool FfmpegDemuxer::full() const
+{
+	for (size_t i = 0; i < state_->streams_.size(); ++i)
+	{
+		const FfmpegPacketQueue& pool = state_->streams_[i].pool;
+		if (pool.packets.size() >= max_packets_ || pool.bytes >= max_bytes_)
+			return true;
+	}
+	return false;
+}
+
+bool FfmpegDemuxer::wanted() const
+{
+	for (size_t i = 0; i < state_->streams_.size(); ++i)
+	{
+		if (state_->streams_[i].subscribers > 0)
+			return true;
+	}
+	return false;
+}
+
+void FfmpegDemuxer::run()
+{
+	while (true)
+	{
+		AVPacket* packet;
+		unsigned generation;
+		{
+			QMutexLocker lock(&mutex_);
+			// Somebody waiting for another stream means that stream packets are
+			// behind the full pool in file. Then overfill, not deadlock.
+			while (!stop_ && (eof_ || !wanted() || (full() && starving_ == 0)))
+				writable_.wait(&mutex_);
+
+			if (stop_)
+				break;
+
+			packet = take_shell();
+			generation = generation_;
+		}
+
+		int err;
+		{
+			QMutexLocker io_lock(&io_mutex_);
+			err = av_read_frame(state_->format_ctx_, packet);
+			// Packet may point into demuxer internal buffer. Then it's the only 
+			// copy, refcounted packets are kept as is.
+			if (err >= 0)
+				err = av_dup_packet(packet);
+		}
+
+		QMutexLocker lock(&mutex_);
+
+		// Seek came between reading and queuing
+		if (generation != generation_)
+		{
+			if (err >= 0)
+				av_free_packet(packet);
+			give_shell(packet);
+			continue;
+		}
+
+		if (err < 0)
+		{
+			give_shell(packet);
+			eof_ = true;
+			readable_.wakeAll();
+			continue;
+		}
+
+		FfmpegPacketQueue* pool = nullptr;
+		for (size_t i = 0; i < state_->streams_.size(); ++i)
+		{
+			FfmpegStream& stream = state_->streams_[i];
+			if (packet->stream_index == stream.stream_id && stream.subscribers > 0) 
+				pool = &stream.pool;
+		}
+
+		if (!pool)
+		{
+			av_free_packet(packet);
+			give_shell(packet);
+			continue;
+		}
+
+		pool->packets.push_back(packet);
+		pool->bytes += packet->size;
+		readable_.wakeAll();
+	}
+}
+
+bool FfmpegDemuxer::pop(size_t stream_id, AVPacket* packet)
+{
+	QMutexLocker lock(&mutex_);
+
+	FfmpegPacketQueue& pool = state_->streams_[stream_id].pool;
+	while (pool.packets.empty() && !eof_ && !stop_)
+	{
+		++starving_;
+		writable_.wakeAll();
+		readable_.wait(&mutex_);
+		--starving_;
+	}
+
+	if (pool.packets.empty())
+		return false;
+
+	AVPacket* shell = pool.packets.front();
+	pool.packets.pop_front();
+	pool.bytes -= shell->size;
+
+	*packet = *shell;
+	give_shell(shell);
+	writable_.wakeAll();
+	return true;
+}
+
+size_t FfmpegDemuxer::queued_bytes()
+{
+	QMutexLocker lock(&mutex_);
+
+	size_t bytes = 0;
+	for (size_t i = 0; i < state_->streams_.size(); ++i)
+		bytes += state_->streams_[i].pool.bytes;
+	return bytes;
+}
+
+bool FfmpegDemuxer::seek(int stream_index, int64_t target, int flags)
+{
+	QMutexLocker io_lock(&io_mutex_);
+	int err = av_seek_frame(state_->format_ctx_, stream_index, target, flags);
+
+	QMutexLocker lock(&mutex_);
+	flush_pools();
+	eof_ = false;
+	++generation_;
+	writable_.wakeAll();
+	return err >= 0;
+}
+
+void FfmpegDemuxer::subscribe(size_t stream_id, int delta)
+{
+	QMutexLocker io_lock(&io_mutex_);
+	QMutexLocker lock(&mutex_);
+
+	FfmpegStream& stream = state_->streams_[stream_id];
+	stream.subscribers = std::max(stream.subscribers + delta, 0);
+
+	AVStream* av_stream = state_->format_ctx_->streams[stream.stream_id];
+	if (stream.subscribers > 0)
+		av_stream->discard = AVDISCARD_DEFAULT;
+	else
+	{
+		av_stream->discard = AVDISCARD_ALL;
+		flush_pool(stream.pool);
+	}
+
+	writable_.wakeAll();
+}
+
+void FfmpegDemuxer::flush_pools()
+{
+	for (size_t i = 0; i < state_->streams_.size(); ++i)
+		flush_pool(state_->streams_[i].pool);
+}
+
+void FfmpegDemuxer::flush_pool(FfmpegPacketQueue& pool)
+{
+	for (size_t j = 0; j < pool.packets.size(); ++j)
+	{
+		av_free_packet(pool.packets[j]);
+		give_shell(pool.packets[j]);
+	}
+
+	pool.packets.clear();
+	pool.bytes = 0;
+}
+
 }// namespace vd
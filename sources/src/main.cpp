@@ -1,5 +1,6 @@
 /** VD */
 #include <vd/proto.hpp>
+#include <vd/ffmpeg.hpp>
 #include <vd/mainwindow.hpp>
 #include <QApplication>
 
@@ -14,6 +15,7 @@ int main(int argc, char *argv[])
 	vd::MediaDecoder md;
 	QApplication app(argc, argv);
 	app_ = &app;
+	vd::FfmpegProbeCache probe_cache; // Needs application for cache location
 	vd::MainWindow w;
 	w.show();
 	return app.exec();
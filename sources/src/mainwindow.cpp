@@ -8,6 +8,7 @@
 #include <QThread>
 #include <QPushButton>
 #include <QStateMachine>
+#include <QCoreApplication>
 
 QApplication* app_;
 
@@ -30,6 +31,14 @@ MainWindow::MainWindow(QWidget *parent)
 
 	preview_.reset(new Preview(ui->video));
 
+	// --audio-latency=low|normal|safe
+	QStringList args = QCoreApplication::arguments();
+	for (int i = 1; i < args.size(); ++i)
+	{
+		if (args[i].startsWith("--audio-latency="))
+			preview_->audio()->set_latency(SdlAudio::latency_by_name(args[i].section('=', 1)));
+	}
+
 	project_.reset(new Project(std::make_shared<SdlVideoPresenter>(ui->video), 
 		std::make_shared<SdlAudioPresenter>(preview_->audio())));
 	project_->_create_test();
@@ -40,11 +49,12 @@ MainWindow::MainWindow(QWidget *parent)
 	
 	pause_state_.reset(new QState());
 	pause_state_->assignProperty(ui->play_btn, "icon", QIcon(":/icon-play.png"));
-	connect(pause_state_.get(), SIGNAL(entered()), preview_.get(), SLOT(pause_play()));
+	// Direct: preview thread sleeps and doesn't run queued slots
+	connect(pause_state_.get(), SIGNAL(entered()), preview_.get(), SLOT(pause_play()), Qt::DirectConnection);
  
 	play_state_.reset(new QState());
 	play_state_->assignProperty(ui->play_btn, "icon", QIcon(":/icon-pause.png"));
-	connect(play_state_.get(), SIGNAL(entered()), preview_.get(), SLOT(continue_play()));
+	connect(play_state_.get(), SIGNAL(entered()), preview_.get(), SLOT(continue_play()), Qt::DirectConnection);
 
 	pause_state_->addTransition(ui->play_btn, SIGNAL(clicked()), play_state_.get());
 	play_state_->addTransition(ui->play_btn, SIGNAL(clicked()), pause_state_.get());
@@ -68,8 +78,9 @@ MainWindow::MainWindow(QWidget *parent)
 MainWindow::~MainWindow()
 {
 	VD_LOG("Stopping preview thread");
-	preview_->stop(); // Signal to stop
-	while (preview_thread_->isRunning()) {} // Waiting
+	preview_->stop(); // Wakes it up
+	preview_thread_->quit();
+	preview_thread_->wait();
 	VD_LOG("Preview thread stopped");
 
 	VD_LOG("Closing UI");
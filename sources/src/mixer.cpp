@@ -0,0 +1,130 @@
+#include <vd/mixer.hpp>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#	define VD_SSE2
+#	include <emmintrin.h>
+#endif
+
+namespace vd {
+namespace mix {
+
+void add(float* dst, const float* src, float gain, size_t n)
+{
+	size_t i = 0;
+
+#ifdef VD_SSE2
+	const __m128 g = _mm_set1_ps(gain);
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128 sum = _mm_add_ps(_mm_loadu_ps(dst + i), _mm_mul_ps(_mm_loadu_ps(src + i), g));
+		_mm_storeu_ps(dst + i, sum);
+	}
+#endif
+
+	for (; i < n; ++i)
+		dst[i] += src[i] * gain;
+}
+
+void float_to_s16(const float* src, const float* dither, float gain, int16_t* dst, size_t n)
+{
+	const float scale = gain * 32767.f;
+	size_t i = 0;
+
+#ifdef VD_SSE2
+	const __m128 s  = _mm_set1_ps(scale);
+	const __m128 lo = _mm_set1_ps(-32768.f);
+	const __m128 hi = _mm_set1_ps(32767.f);
+	for (; i + 8 <= n; i += 8)
+	{
+		__m128 a = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(src + i),     s), _mm_loadu_ps(dither + i));
+		__m128 b = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(src + i + 4), s), _mm_loadu_ps(dither + i + 4));
+		a = _mm_min_ps(_mm_max_ps(a, lo), hi);
+		b = _mm_min_ps(_mm_max_ps(b, lo), hi);
+		__m128i packed = _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b));
+		_mm_storeu_si128((__m128i*) (dst + i), packed);
+	}
+#endif
+
+	for (; i < n; ++i)
+	{
+		float v = src[i] * scale + dither[i];
+		v = std::min(32767.f, std::max(-32768.f, v));
+		dst[i] = int16_t(v >= 0.f? v + 0.5f : v - 0.5f);
+	}
+}
+
+}// namespace mix
+
+
+//
+// AudioMixer
+//
+AudioMixer::AudioMixer()
+:	channels_(0),
+	block_(0),
+	seed_(22222)
+{
+}
+
+void AudioMixer::set_format(int channels)
+{
+	channels_ = channels;
+	bus_.assign(channels, std::vector<float>());
+}
+
+void AudioMixer::begin(size_t samples)
+{
+	block_ = samples;
+	for (int c = 0; c < channels_; ++c)
+		bus_[c].assign(samples, 0.f);
+}
+
+void AudioMixer::add(const float* src, size_t offset, size_t samples, float gain)
+{
+	VD_ASSERT3(offset + samples <= block_, "Samples are out of mixer block", return);
+	if (!samples || !channels_)
+		return;
+
+	plane_.resize(samples);
+	for (int c = 0; c < channels_; ++c)
+	{
+		for (size_t i = 0; i < samples; ++i)
+			plane_[i] = src[i * channels_ + c];
+
+		mix::add(&bus_[c][offset], &plane_[0], gain, samples);
+	}
+}
+
+void AudioMixer::end(float gain, int16_t* dst)
+{
+	if (!block_ || !channels_)
+		return;
+
+	out_.resize(block_);
+	for (int c = 0; c < channels_; ++c)
+	{
+		fill_dither(block_);
+		mix::float_to_s16(&bus_[c][0], &dither_[0], gain, &out_[0], block_);
+
+		for (size_t i = 0; i < block_; ++i)
+			dst[i * channels_ + c] = out_[i];
+	}
+}
+
+void AudioMixer::fill_dither(size_t n)
+{
+	static const float unit = 1.f / 16777216.f;
+
+	// Difference of two uniform values has triangular distribution in (-1, 1)
+	dither_.resize(n);
+	for (size_t i = 0; i < n; ++i)
+	{
+		seed_ = seed_ * 1664525u + 1013904223u;
+		float a = (seed_ >> 8) * unit;
+		seed_ = seed_ * 1664525u + 1013904223u;
+		float b = (seed_ >> 8) * unit;
+		dither_[i] = a - b;
+	}
+}
+
+}// namespace vd
@@ -51,6 +51,15 @@ bool operator < (const Id8& a, const Id8& b)
 	return a.num_ < b.num_;
 }
 
+bool operator < (const DecodingPolicy& a, const DecodingPolicy& b)
+{
+	if (a.threading != b.threading)
+		return a.threading < b.threading;
+	if (a.threads != b.threads)
+		return a.threads < b.threads;
+	return a.mapped_io < b.mapped_io;
+}
+
 
 Preview::Preview(SdlRenderer* renderer)
 :	renderer_(renderer),
@@ -60,12 +69,37 @@ Preview::Preview(SdlRenderer* renderer)
 	project_(nullptr),
 	pause_(true),
 	playing_(0),
-	prev_frame_(0)
+	prev_frame_(0),
+	prefetcher_(nullptr),
+	producer_(nullptr),
+	seek_target_(0),
+	seek_pending_(false),
+	seeking_(false),
+	scrubbing_(false),
+	seek_scrub_(false),
+	scrubbed_(false)
 {
 	audio_ = new SdlAudio();
 	preset_ = new PreviewPreset;
 	audio_channel_ = new SdlAudioChannel();
 	audio_channel_->volume = 1.;
+	prefetcher_ = new MediaPrefetcher();
+	prefetcher_->start(QThread::LowPriority);
+	producer_ = new SdlAudioProducer(audio_);
+	producer_->start(QThread::HighPriority);
+}
+
+Preview::~Preview()
+{
+	// Both stop and join themselves. Producer reads backend_ and audio_.
+	delete producer_;
+	delete prefetcher_;
+}
+
+void Preview::prefetch()
+{
+	if (backend_)
+		prefetcher_->update(backend_->scene(), playing_);
 }
 
 void Preview::_play_video(const AString& filename) 
@@ -76,8 +110,6 @@ void PlaySound(char *file);
 
 void Preview::_start_play()
 {
-	stopped_ = false;
-
 	time_mark time_base = backend_->time_base();
 	
 	printf("q %lld\n", time_base);
@@ -86,15 +118,30 @@ void Preview::_start_play()
 
 	time_mark pres_time = 0;
 
-	while (!stopped_)
+	while (true)
 	{
 		QCoreApplication::processEvents();
 
-		if (pause_)
+		serve_seek();
+
+		bool paused = false;
+		{
+			QMutexLocker lock(&mutex_);
+			if (stopped_)
+				break;
+			paused = pause_;
+		}
+
+		if (paused)
 		{
 			if (prev_frame_ != 0)
 				TimeLineWidget::i().set_playing(false);
 			prev_frame_ = 0;
+
+			// No CPU is spent till continue, seek or stop
+			QMutexLocker lock(&mutex_);
+			while (pause_ && !stopped_ && !seek_pending_)
+				wait_.wait(&mutex_);
 			continue;
 		}
 
@@ -106,61 +153,192 @@ void Preview::_start_play()
 
 		MovieResourcePtr video_frame = backend_->next_video();
 
+		// Frame pts is in media time, clock runs in timeline time
 		if (video_frame)
-			pres_time = video_frame->pts();
+			pres_time = backend_->video_time(video_frame->pts());
 		else
 			pres_time += backend_->time_base();
 
-		backend_->update_preset(*preset_);
-
-		do
+		PreviewPreset preset;
 		{
-			while (!audio_->enough_audio())
-			{
-				MovieResourcePtr audio_data = backend_->next_audio();
-				audio_->queue_audio(*audio_channel_, audio_data);
-			}
+			QMutexLocker lock(&mutex_);
+			preset = *preset_;
+		}
+		backend_->update_preset(preset);
+		prefetch();
 
+		// Sleeps till frame deadline, audio is fed by its own thread
+		bool interrupted = false;
+		while (true)
+		{
 			time_mark curtime = av_gettime();
-			time_mark dt = curtime - prev_frame_;
-			playing_ += dt;
+			time_mark heard = audio_clock();
+			if (heard)
+				playing_ = heard;
+			else
+				playing_ += curtime - prev_frame_;
 			prev_frame_ = curtime;
 			TimeLineWidget::i().notify_current_preview_time(playing_);
+
+			if (playing_ >= pres_time)
+				break;
+
+			QMutexLocker lock(&mutex_);
+			if (pause_ || stopped_ || seek_pending_)
+			{
+				interrupted = true;
+				break;
+			}
+
+			time_mark sleep = pres_time - playing_;
+			wait_.wait(&mutex_, std::max<unsigned long>(1, (unsigned long) (sleep / 1000)));
 		}
-		while (playing_ < pres_time);
-		//printf("%lld %lld\n", playing_, pres_time);
-		
-		renderer_->render_video(video_frame);
 
-		//mutex_.unlock();
+		if (!interrupted)
+			renderer_->render_video(video_frame);
 	}
 }
 
 void Preview::continue_play()
 {
-	pause_ = false;
+	{
+		QMutexLocker lock(&mutex_);
+		pause_ = false;
+		wait_.wakeAll();
+	}
+	producer_->set_running(true);
 }
 
 void Preview::pause_play()
 {
+	producer_->set_running(false);
+
+	QMutexLocker lock(&mutex_);
 	pause_ = true;
+	wait_.wakeAll();
 }
 
 void Preview::stop()
 {
-	stopped_ = true;
+	{
+		QMutexLocker lock(&mutex_);
+		stopped_ = true;
+		wait_.wakeAll();
+	}
+	prefetcher_->stop();
+	producer_->stop();
+	producer_->wait();
+}
+
+time_mark Preview::audio_clock()
+{
+	if (!backend_ || !audio_->is_open())
+		return 0;
+
+	time_mark position = backend_->audio_position();
+	time_mark latency  = audio_->latency();
+	return position > latency? position - latency : 0;
 }
 
 void Preview::seek(time_mark t)
 {
 	playing_ = t;
 	backend_->sync(t);
+	audio_->flush(backend_->audio_serial());
+
+	// Sync may have been interrupted, no use decoding stale frame
+	if (seek_superseded())
+		return;
+
+	prefetch();
 	MovieResourcePtr video_frame = backend_->next_video();
-	if (video_frame)
-		printf("Found: %lld %lld\n", t, video_frame->pts());
+
+	// Stale already, newest one is shown instead
+	if (seek_superseded())
+		return;
+
+	renderer_->render_video(video_frame);
+}
+
+void Preview::post_seek(time_mark t)
+{
+	bool interrupt = false;
+	{
+		QMutexLocker lock(&mutex_);
+		seek_target_  = t;
+		seek_pending_ = true;
+		seek_scrub_   = scrubbing_;
+		scrubbed_     = scrubbed_ || scrubbing_;
+		interrupt     = seeking_;
+		wait_.wakeAll();
+	}
+
+	if (interrupt && backend_)
+		backend_->interrupt();
+}
+
+void Preview::set_scrubbing(bool scrubbing)
+{
+	bool interrupt = false;
+	{
+		QMutexLocker lock(&mutex_);
+		scrubbing_ = scrubbing;
+		if (scrubbing || !scrubbed_)
+			return;
+
+		// Exact frame where drag stopped
+		scrubbed_     = false;
+		seek_pending_ = true;
+		seek_scrub_   = false;
+		interrupt     = seeking_;
+		wait_.wakeAll();
+	}
+
+	if (interrupt && backend_)
+		backend_->interrupt();
+}
+
+void Preview::scrub(time_mark t)
+{
+	playing_ = t;
+	MovieResourcePtr video_frame = backend_->scrub(t);
+
+	if (seek_superseded())
+		return;
+
 	renderer_->render_video(video_frame);
 }
 
+void Preview::serve_seek()
+{
+	time_mark t = 0;
+	bool scrub = false;
+	{
+		QMutexLocker lock(&mutex_);
+		if (!seek_pending_)
+			return;
+
+		t     = seek_target_;
+		scrub = seek_scrub_;
+		seek_pending_ = false;
+		seeking_      = true;
+	}
+
+	if (scrub)
+		this->scrub(t);
+	else
+		seek(t);
+
+	QMutexLocker lock(&mutex_);
+	seeking_ = false;
+}
+
+bool Preview::seek_superseded()
+{
+	QMutexLocker lock(&mutex_);
+	return seek_pending_;
+}
+
 #define NUM_SOUNDS 2
 struct sample {
     Uint8 *data;
@@ -241,22 +419,70 @@ void Preview::bind(Project* project)
 	frame.frame = 0;
 	//backend_->fetch_video(renderer_, com, frame);
 
-	FfmpegDecodingState* state = dynamic_cast<FfmpegDecodingState*>(com->decoder_.get());
-	renderer_->init_overlay(state->width(), state->height());
-
-	AVCodecContext* audio_codec_ctx = state->streams_[1].codec_ctx;
+	MediaInfo info = com->clip_->media()->info();
+	renderer_->init_overlay(info.width, info.height);
 
 	SdlAudioSpec spec;
-	spec.freq     = audio_codec_ctx->sample_rate;
-	spec.channels = audio_codec_ctx->channels;
+	spec.freq     = info.sample_rate;
+	spec.channels = info.channels;
 	audio_->open(spec);
 
 	backend_ = new PreviewState(project_);
+	backend_->set_audio_format(audio_->spec().freq, audio_->spec().channels);
+	audio_->flush(backend_->audio_serial());
+	producer_->set_source(backend_, audio_channel_);
 }
 
 void Preview::set_audio_volume(float audio_volume)
 {
-	audio_channel_->volume = audio_volume;
+	// Master gain of mixer, preview thread passes it to backend
+	QMutexLocker lock(&mutex_);
+	preset_->audio_volume = audio_volume;
+}
+
+void KeyframeIndex::add(const Entry& entry)
+{
+	if (entries_.empty() || entries_.back().pts < entry.pts)
+	{
+		entries_.push_back(entry);
+		return;
+	}
+
+	std::vector<Entry>::iterator at = std::upper_bound(entries_.begin(), entries_.end(), entry, 
+		[] (const Entry& a, const Entry& b) { return a.pts < b.pts; });
+	entries_.insert(at, entry);
+}
+
+const KeyframeIndex::Entry* KeyframeIndex::find(time_mark t) const
+{
+	std::vector<Entry>::const_iterator after = std::upper_bound(entries_.begin(), entries_.end(), t, 
+		[] (time_mark t, const Entry& e) { return t < e.pts; });
+
+	if (after == entries_.begin())
+		return nullptr;
+
+	return &*(after - 1);
+}
+
+const KeyframeIndex::Entry* KeyframeIndex::after(time_mark t) const
+{
+	std::vector<Entry>::const_iterator after = std::upper_bound(entries_.begin(), entries_.end(), t, 
+		[] (time_mark t, const Entry& e) { return t < e.pts; });
+
+	if (after == entries_.end())
+		return nullptr;
+
+	return &*after;
+}
+
+size_t KeyframeIndex::preroll(const Entry& key, time_mark t) const
+{
+	if (frame_duration_ == 0 || t <= key.pts)
+		return 0;
+
+	// Target past the group is past the next keyframe too
+	size_t frames = size_t((t - key.pts) / frame_duration_);
+	return key.gop > 0? std::min(frames, size_t(key.gop - 1)) : frames;
 }
 
 Media::Media(const AString& filename)
@@ -264,12 +490,25 @@ Media::Media(const AString& filename)
 {
 }
 
-DecodingStatePtr Media::decoder()
+MediaInfo Media::info()
 {
-	if (decoder_.get() == nullptr)
-		decoder_ = MediaDecoder::i().decode(this);
+	QMutexLocker lock(&info_mutex_);
+	if (!info_.probed)
+		MediaDecoder::i().probe(this, &info_);
 
-	return decoder_;
+	return info_;
+}
+
+KeyframeIndexPtr Media::keyframes() const
+{
+	QMutexLocker lock(&keyframes_mutex_);
+	return keyframes_;
+}
+
+void Media::set_keyframes(KeyframeIndexPtr keyframes)
+{
+	QMutexLocker lock(&keyframes_mutex_);
+	keyframes_ = keyframes;
 }
 
 }
\ No newline at end of file
@@ -6,18 +6,21 @@ extern "C" {
 #include <libavformat/avformat.h>
 #include <libswscale/swscale.h>
 #include <libswresample/swresample.h>
+#include <libavutil/time.h>
 }
 
 namespace vd {
 
-SdlVideoFrame::SdlVideoFrame(SDL_Overlay* overlay)
+SdlVideoFrame::SdlVideoFrame(SDL_Overlay* overlay, QMutex* mutex)
 :	IFrame(nullptr),
-	overlay_(overlay)
+	overlay_(overlay),
+	mutex_(mutex)
 {
 }
 
 SdlVideoFrame::~SdlVideoFrame()
 {
+	QMutexLocker lock(mutex_);
 	SDL_FreeYUVOverlay(overlay_);
 }
 
@@ -56,7 +59,8 @@ void SdlFfmpegBlit::blit(SdlVideoFrame* d, void* s)
 SdlRenderer::SdlRenderer(QWidget* parent, Qt::WindowFlags f) 
 :	QWidget(parent, f),
 	screen_(nullptr),
-	overlay_(nullptr)
+	overlay_(nullptr),
+	mutex_(QMutex::Recursive)
 {
     setAttribute(Qt::WA_PaintOnScreen);
     setUpdatesEnabled(false);
@@ -87,6 +91,7 @@ SdlRenderer::~SdlRenderer()
 
 void SdlRenderer::init_overlay(int width, int height) 
 {
+	QMutexLocker lock(&mutex_);
 	screen_  = SDL_SetVideoMode(width, height, 24, 0);
 	overlay_ = SDL_CreateYUVOverlay(width, height,
 		SDL_YV12_OVERLAY, screen_);
@@ -106,8 +111,9 @@ void SdlRenderer::init_overlay(int width, int height)
 
 SdlVideoFrame* SdlRenderer::new_frame()
 {
+	QMutexLocker lock(&mutex_);
 	return new SdlVideoFrame(SDL_CreateYUVOverlay(screen_->w, screen_->h,
-		SDL_YV12_OVERLAY, screen_));
+		SDL_YV12_OVERLAY, screen_), &mutex_);
 }
 
 void SdlRenderer::free_frame(SdlVideoFrame* frame)
@@ -117,6 +123,7 @@ void SdlRenderer::free_frame(SdlVideoFrame* frame)
 
 void SdlRenderer::render_video(MovieResourcePtr video_frame) 
 {
+	QMutexLocker lock(&mutex_);
 	if (SdlVideoFrame* frame = dynamic_cast<SdlVideoFrame*>(video_frame.get()))
 	{
 		SDL_Rect rect;
@@ -140,10 +147,17 @@ void SdlRenderer::render_video(MovieResourcePtr video_frame)
 }
 
 SdlFfmpegAudioDecoder::SdlFfmpegAudioDecoder(SdlAudio* audio)
-:	audio_(audio)
+:	audio_(audio),
+	clock_(0)
 {
 }
 
+SdlFfmpegAudioDecoder::~SdlFfmpegAudioDecoder()
+{
+	for (Resamplers::iterator i = resamplers_.begin(); i != resamplers_.end(); ++i)
+		swr_free(&i->second.ctx);
+}
+
 SdlVideoPresenter::SdlVideoPresenter(SdlRenderer* renderer)
 :	renderer_(renderer),
 	ffmpeg_blitter_(nullptr)
@@ -157,6 +171,8 @@ IFramePtr SdlVideoPresenter::prepare(IFramePtr frame)
 		if (!ff_frame)
 			return IFramePtr();
 
+		// Scaler is shared too, so whole conversion goes under renderer lock
+		QMutexLocker lock(renderer_->mutex());
 		SdlVideoFrame* sdl_frame = renderer_->new_frame();
 		sdl_frame->set_pts(frame->pts());
 
@@ -188,10 +204,32 @@ SdlBlitter* SdlVideoPresenter::get_blitter(IFramePtr frame)
 }
 
 SdlAudioFrame::SdlAudioFrame()
-:	IFrame(nullptr)
+:	IFrame(nullptr),
+	size(0),
+	freq(0),
+	format(AV_SAMPLE_FMT_NONE),
+	sample_bytes(0),
+	serial(0)
 {
 }
 
+void SdlAudioFrame::trim(size_t head, size_t tail)
+{
+	size_t n = samples();
+	if (head + tail >= n)
+	{
+		size = 0;
+		return;
+	}
+
+	size = (n - head - tail) * sample_bytes;
+	if (head)
+	{
+		memmove(buf, buf + head * sample_bytes, size);
+		set_pts(pts() + head * AV_TIME_BASE / freq);
+	}
+}
+
 SdlAudioPresenter::SdlAudioPresenter(SdlAudio* audio)
 :	audio_(audio),
 	audio_decoder_(nullptr)
@@ -204,6 +242,9 @@ IFramePtr SdlAudioPresenter::prepare(IFramePtr frame)
 	if (FfmpegFrame* ff_frame = dynamic_cast<FfmpegFrame*>(frame.get()))
 	{
 		SdlAudioFrame* sdl_audio_frame = new SdlAudioFrame();
+		sdl_audio_frame->set_pts(frame->pts());
+
+		QMutexLocker lock(&mutex_);
 		if (audio_decoder_->decode(sdl_audio_frame, ff_frame))
 		{
 			//audio_->write(audio_channel_, *sdl_audio_frame);
@@ -286,26 +327,87 @@ static int synchronize_audio(const SdlAudioSpec& spec, int nb_samples)
     return wanted_nb_samples;
 }
 
-bool SdlFfmpegAudioDecoder::decode(SdlAudioFrame* dst_frame, FfmpegFrame* src_frame)
+SwrContext* SdlFfmpegAudioDecoder::resampler(FfmpegFrame* src_frame)
 {
 	AVFrame* frame = src_frame->frame;
 	const SdlAudioSpec& spec = audio_->spec();
+	int64_t dec_channel_layout = get_valid_channel_layout(frame->channel_layout, av_frame_get_channels(frame));
 
-	audio_diff_threshold = 2.0 * 1024 / av_samples_get_buffer_size(NULL, spec.channels, spec.freq, spec.format, 1);
+	Resamplers::iterator found = resamplers_.find(src_frame->source);
+	if (found != resamplers_.end())
+	{
+		Resampler& r = found->second;
+		if (r.channel_layout == dec_channel_layout && r.format == frame->format 
+			&& r.sample_rate == frame->sample_rate && r.out_rate == spec.freq)
+		{
+			// Samples buffered before seek don't belong after it
+			if (r.serial != src_frame->serial && swr_init(r.ctx) < 0)
+				VD_ERR("Resampler wasn't reset");
 
-	int64_t dec_channel_layout = get_valid_channel_layout(frame->channel_layout, av_frame_get_channels(frame));
+			r.serial = src_frame->serial;
+			r.used   = ++clock_;
+			return r.ctx;
+		}
+
+		swr_free(&found->second.ctx);
+		resamplers_.erase(found);
+	}
 
+	// Every source comes out in device layout, so tracks can be mixed
 	SwrContext* swr_ctx = swr_alloc_set_opts(NULL,
-		dec_channel_layout,                    spec.format,          spec.freq,
+		av_get_default_channel_layout(spec.channels), track_format, spec.freq,
 		dec_channel_layout, (AVSampleFormat) frame->format, frame->sample_rate,
         0, NULL);
 
-	int err;
-	if (!swr_ctx || (err = swr_init(swr_ctx)) < 0)
+	if (!swr_ctx || swr_init(swr_ctx) < 0)
 	{
+		swr_free(&swr_ctx);
 		VD_ERR("Context wasn't created!");
-		return false;
+		return nullptr;
+	}
+
+	Resampler r;
+	r.ctx            = swr_ctx;
+	r.channel_layout = dec_channel_layout;
+	r.format         = frame->format;
+	r.sample_rate    = frame->sample_rate;
+	r.out_rate       = spec.freq;
+	r.serial         = src_frame->serial;
+	r.used           = ++clock_;
+	resamplers_[src_frame->source] = r;
+	evict();
+	return swr_ctx;
+}
+
+void SdlFfmpegAudioDecoder::evict()
+{
+	// More than audio tracks and prerolled clips ever decode at once
+	static const size_t max_resamplers = 16;
+
+	while (resamplers_.size() > max_resamplers)
+	{
+		Resamplers::iterator oldest = resamplers_.begin();
+		for (Resamplers::iterator i = resamplers_.begin(); i != resamplers_.end(); ++i)
+		{
+			if (i->second.used < oldest->second.used)
+				oldest = i;
+		}
+
+		swr_free(&oldest->second.ctx);
+		resamplers_.erase(oldest);
 	}
+}
+
+bool SdlFfmpegAudioDecoder::decode(SdlAudioFrame* dst_frame, FfmpegFrame* src_frame)
+{
+	AVFrame* frame = src_frame->frame;
+	const SdlAudioSpec& spec = audio_->spec();
+
+	audio_diff_threshold = 2.0 * 1024 / av_samples_get_buffer_size(NULL, spec.channels, spec.freq, spec.format, 1);
+
+	SwrContext* swr_ctx = resampler(src_frame);
+	if (!swr_ctx)
+		return false;
 
 	int64_t wanted_nb_samples = synchronize_audio(spec, frame->nb_samples);
 	//int64_t wanted_nb_samples = frame->nb_samples;
@@ -315,7 +417,7 @@ bool SdlFfmpegAudioDecoder::decode(SdlAudioFrame* dst_frame, FfmpegFrame* src_fr
 		const uint8_t** src = (const uint8_t**) src_frame->frame->extended_data;
 		uint8_t* dst        = dst_frame->buf;
 		int dst_max_samples = wanted_nb_samples * spec.freq / frame->sample_rate + 256;
-		int out_size  = av_samples_get_buffer_size(NULL, spec.channels, dst_max_samples, spec.format, 0);
+		int out_size  = av_samples_get_buffer_size(NULL, spec.channels, dst_max_samples, track_format, 0);
 
 		if (dst_frame->buf_allocated <= out_size)
 		{
@@ -330,8 +432,12 @@ bool SdlFfmpegAudioDecoder::decode(SdlAudioFrame* dst_frame, FfmpegFrame* src_fr
 				VD_ERR("swr_set_compensation() failed\n");
 		}
 
+		// Output starts with samples held back from previous frames
+		time_mark delay = time_mark(swr_get_delay(swr_ctx, spec.freq)) * AV_TIME_BASE / spec.freq;
+		dst_frame->set_pts(src_frame->pts() > delay? src_frame->pts() - delay : 0);
+
 		int conv_sz = swr_convert(swr_ctx, &dst, dst_max_samples, src, frame->nb_samples);
-		int resampled_data_size = conv_sz * spec.channels * av_get_bytes_per_sample(spec.format);
+		int resampled_data_size = conv_sz * spec.channels * av_get_bytes_per_sample(track_format);
 
         if (conv_sz < 0) {
             VD_ERR("swr_convert() failed");
@@ -340,9 +446,10 @@ bool SdlFfmpegAudioDecoder::decode(SdlAudioFrame* dst_frame, FfmpegFrame* src_fr
             VD_ERR("audio buffer is probably too small");
         }
 
-		swr_free(&swr_ctx);
-
-		dst_frame->size = resampled_data_size;
+		dst_frame->size         = resampled_data_size;
+		dst_frame->freq         = spec.freq;
+		dst_frame->format       = track_format;
+		dst_frame->sample_bytes = spec.channels * av_get_bytes_per_sample(track_format);
 
 		return true;
 	}
@@ -357,15 +464,43 @@ void sdl_audio_callback_impl(void* audio_ptr, uint8_t* stream, int len)
 }
 
 SdlAudio::SdlAudio()
-:	write_(false),
-	audio_buf_index_(0)
+:	latency_(L_NORMAL),
+	opened_(false),
+	ring_(std::make_shared<AudioBuffer>(64 * 1024)),
+	target_fill_(8 * 1024),
+	device_period_(0),
+	measured_period_(0),
+	last_callback_(0),
+	flush_(false),
+	mix_buf_(SdlAudioFrame::buf_allocated),
+	serial_(0)
 {
 }
 
+SdlAudio::Latency SdlAudio::latency_by_name(const QString& name)
+{
+	if (name == "low")
+		return L_LOW;
+	if (name == "safe")
+		return L_SAFE;
+	return L_NORMAL;
+}
+
 void SdlAudio::open(const SdlAudioSpec& sp)
 {
+	// Device buffer samples and how many of them ring keeps ahead
+	static const int device_samples[] = { 256, 1024, 4096 };
+	static const int ring_periods[]   = { 4, 2, 3 };
+	// Producer writes whole blocks of mixer, ring takes one above target
+	static const size_t mixer_block = 1024;
+
+	if (opened_)
+	{
+		SDL_CloseAudio();
+		opened_ = false;
+	}
+
 	spec_ = sp;
-	write_ = false;
 
 	spec_.format = AV_SAMPLE_FMT_S16;
 	spec_.channel_layout = 0;
@@ -376,13 +511,14 @@ void SdlAudio::open(const SdlAudioSpec& sp)
 	wanted_spec.format   = AUDIO_S16SYS;
 	wanted_spec.channels = sp.channels;
 	wanted_spec.silence  = 0;
-	wanted_spec.samples  = 1024;
+	wanted_spec.samples  = device_samples[latency_];
 	wanted_spec.callback = sdl_audio_callback_impl;
 	wanted_spec.userdata = this;
 
 	if (SDL_OpenAudio(&wanted_spec, &spec) < 0) 
 	{
 		VD_ERR("SDL_OpenAudio error: " << SDL_GetError());
+		return;
 	}
 
 	if (spec.format != AUDIO_S16SYS) 
@@ -390,45 +526,62 @@ void SdlAudio::open(const SdlAudioSpec& sp)
         VD_ERR("SDL advised audio format AUDIO_S16SYS is not supported!\n");
     }
 
-	audio_buf_index_ = 0;
+	// Device may grant other buffer than asked
+	spec_.freq     = spec.freq;
+	spec_.channels = spec.channels;
+	device_period_ = time_mark(spec.samples) * AV_TIME_BASE / spec.freq;
+	measured_period_ = device_period_;
+	last_callback_   = 0;
+	flush_           = false;
+
+	// Callback isn't running till SDL_PauseAudio(0)
+	size_t sample_bytes = spec.channels * av_get_bytes_per_sample(spec_.format);
+	target_fill_ = spec.size * ring_periods[latency_];
+	ring_ = std::make_shared<AudioBuffer>(target_fill_ + 2 * mixer_block * sample_bytes);
+	opened_ = true;
+
+	VD_LOG("Audio device buffer " << spec.samples << " samples, ring " << target_fill_ << " bytes");
 }
 
-
-void SdlAudio::sigwrite()
+time_mark SdlAudio::latency() const
 {
-	QMutexLocker lock(&mutex_);
-	write_ = true;
+	time_mark period = std::max<time_mark>(device_period_, measured_period_.load());
+
+	// Part of device buffer is played since last callback
+	int64_t last  = last_callback_.load();
+	time_mark since = last? std::min<time_mark>(av_gettime() - last, period) : 0;
+
+	// Device plays one buffer while callback fills the other
+	return buffered_time() + 2 * period - since;
 }
 
-bool SdlAudio::enough_audio() 
+
+bool SdlAudio::enough_audio() const
 { 
-	QMutexLocker lock(&mutex_);
-	return write_; 
+	return ring_->size() >= target_fill_; 
 }
 
-void SdlAudio::_audio_callback(uint8_t* stream, int len)
+time_mark SdlAudio::buffered_time() const
 {
-	QMutexLocker lock(&mutex_);
-
-	//while (!write_ && audio_buf_index_ >= (size_t)len) {}
-
-	if (write_ && audio_buf_index_ >= (size_t)len)
-	{
-		// Copy to sdl stream
-		memcpy(stream, audio_buf_, len);
-
-		// Move least bytes to buffer beginning 
-		memmove(audio_buf_, audio_buf_ + len, audio_buf_index_ - len);
-		audio_buf_index_ -= len;
-		memset(audio_buf_ + audio_buf_index_ + 1, 0, audio_buf_sz_ - audio_buf_index_ - 1);
+	size_t rate = spec_.freq * spec_.channels * av_get_bytes_per_sample(spec_.format);
+	return rate? time_mark(ring_->size()) * AV_TIME_BASE / rate : 0;
+}
 
-		write_ = false;
-	}
-	else
-	{
-		memset(stream, 0, len);
-		//VD_ERR("Few");
-	}
+void SdlAudio::_audio_callback(uint8_t* stream, int len)
+{
+	if (flush_.exchange(false))
+		ring_->clear();
+
+	// Real period of device, it may ask more often or more at once than granted
+	int64_t now  = av_gettime();
+	int64_t last = last_callback_.exchange(now);
+	int64_t period = measured_period_.load();
+	if (last && now - last < 4 * period)
+		measured_period_ = (period * 7 + (now - last)) / 8;
+
+	size_t got = ring_->read(stream, len);
+	if (got < (size_t) len)
+		memset(stream + got, 0, len - got);
 }
 
 void SdlAudio::queue_audio(const SdlAudioChannel& channel, MovieResourcePtr ptr)
@@ -439,19 +592,115 @@ void SdlAudio::queue_audio(const SdlAudioChannel& channel, MovieResourcePtr ptr)
 	}
 }
 
+void SdlAudio::flush(u64 serial)
+{
+	QMutexLocker lock(&write_mutex_);
+	serial_ = serial;
+	flush_  = true;
+}
+
 bool SdlAudio::write(const SdlAudioChannel& channel, const SdlAudioFrame& frame)
 {
-	QMutexLocker lock(&mutex_);
-	size_t written = frame.size;
-	SDL_MixAudio(audio_buf_ + audio_buf_index_, frame.buf, written, channel.volume * SDL_MIX_MAXVOLUME);
-	//memcpy(audio_buf_ + audio_buf_index_, frame.buf, written);
-	audio_buf_index_ += written;
-	write_ = audio_buf_index_ > audio_buf_sz_ / 2;
-	return audio_buf_index_ > audio_buf_sz_ / 2;
+	// Mixed before seek, but came after flush
+	QMutexLocker lock(&write_mutex_);
+	if (frame.serial != serial_)
+		return enough_audio();
+
+	// Mixer has applied gains already
+	const uint8_t* data = frame.buf;
+	size_t size = std::min(frame.size, mix_buf_.size());
+	if (channel.volume != 1.f)
+	{
+		memset(&mix_buf_[0], 0, size);
+		SDL_MixAudio(&mix_buf_[0], frame.buf, size, channel.volume * SDL_MIX_MAXVOLUME);
+		data = &mix_buf_[0];
+	}
+
+	size_t written = ring_->write(data, size);
+	if (written < size)
+		VD_ERR("Audio ring overflow, " << size - written << " bytes dropped");
+
+	return enough_audio();
 }
 
 void SdlAudio::render_audio(MovieResourcePtr audio)
 {
 }
 
+//
+// SdlAudioProducer
+//
+SdlAudioProducer::SdlAudioProducer(SdlAudio* audio)
+:	audio_(audio),
+	source_(nullptr),
+	channel_(nullptr),
+	running_(false),
+	stop_(false)
+{
+}
+
+SdlAudioProducer::~SdlAudioProducer()
+{
+	stop();
+	wait();
+}
+
+void SdlAudioProducer::set_source(PreviewState* source, SdlAudioChannel* channel)
+{
+	QMutexLocker lock(&mutex_);
+	source_  = source;
+	channel_ = channel;
+	wake_.wakeAll();
+}
+
+void SdlAudioProducer::set_running(bool running)
+{
+	QMutexLocker lock(&mutex_);
+	running_ = running;
+	wake_.wakeAll();
+}
+
+void SdlAudioProducer::stop()
+{
+	QMutexLocker lock(&mutex_);
+	stop_ = true;
+	wake_.wakeAll();
+}
+
+void SdlAudioProducer::run()
+{
+	while (true)
+	{
+		PreviewState* source = nullptr;
+		SdlAudioChannel* channel = nullptr;
+		{
+			QMutexLocker lock(&mutex_);
+			while (!stop_ && (!running_ || !source_))
+				wake_.wait(&mutex_);
+
+			if (stop_)
+				break;
+
+			source  = source_;
+			channel = channel_;
+		}
+
+		while (!audio_->enough_audio())
+		{
+			MovieResourcePtr mixed = source->next_audio();
+			if (!mixed)
+				break;
+
+			audio_->queue_audio(*channel, mixed);
+		}
+
+		// Device drains ring meanwhile, comes back with half of it left
+		time_mark sleep = audio_->buffered_time() / 2;
+
+		QMutexLocker lock(&mutex_);
+		if (!stop_ && running_)
+			wake_.wait(&mutex_, std::max<unsigned long>(1, (unsigned long) (sleep / 1000)));
+	}
+}
+
 }// namespace vd
@@ -8,6 +8,14 @@
 #include <QLineEdit>
 #include <QGraphicsProxyWidget>
 #include <QTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <limits>
+
+#ifdef Q_OS_UNIX
+#	include <fcntl.h>
+#	include <unistd.h>
+#endif
 
 namespace vd {
 
@@ -17,26 +25,221 @@ namespace vd {
 MediaDecoder* MediaDecoder::instance_ = nullptr;
 
 MediaDecoder::MediaDecoder()
+:	clock_(0),
+	reuse_window_(5 * AV_TIME_BASE),
+	max_per_media_(4),
+	max_open_(32),
+	max_bytes_(1024 * 1024 * 1024)
 {
 	VD_ASSERT2(!instance_, "MediaDecoder must have only instance!");
 	instance_ = this;
 }
 
-DecodingStatePtr MediaDecoder::decode(MediaPtr media)
+DecodingStatePtr MediaDecoder::acquire(Media* media, time_mark position, int stream_id)
+{
+	QMutexLocker lock(&mutex_);
+
+	Pool& pool = decoders_[DecoderKey(media->filename(), media->decoding_policy())];
+
+	Slot* nearest = nullptr;
+	Slot* oldest  = nullptr;
+	for (size_t i = 0; i < pool.size(); ++i)
+	{
+		Slot& slot = pool[i];
+		if (slot.busy)
+			continue;
+
+		time_mark at = slot.state->position();
+		if (at <= position && position - at <= reuse_window_)
+		{
+			if (!nearest || nearest->state->position() < at)
+				nearest = &slot;
+		}
+
+		if (!oldest || slot.last_used < oldest->last_used)
+			oldest = &slot;
+	}
+
+	// While pool isn't full new state keeps positions of idle ones. When 
+	// everything is busy pool grows over the limit.
+	Slot* taken = nearest;
+	if (!taken && pool.size() >= max_per_media_)
+		taken = oldest;
+
+	int unsubscribed = -1;
+	DecodingStatePtr state;
+	if (taken)
+	{
+		taken->busy      = true;
+		taken->last_used = ++clock_;
+
+		// Same stream keeps its queued packets
+		unsubscribed  = taken->stream;
+		taken->stream = stream_id;
+		state = taken->state;
+		lock.unlock();
+	}
+	else
+	{
+		// Opening reads file, other acquirers don't wait for it
+		lock.unlock();
+		state = open(media);
+		if (!state)
+			return DecodingStatePtr();
+
+		Slot slot;
+		slot.state     = state;
+		slot.busy      = true;
+		slot.stream    = stream_id;
+		lock.relock();
+		slot.last_used = ++clock_;
+		pool.push_back(slot);
+		lock.unlock();
+	}
+
+	enforce_budget(state);
+
+	// Slot is busy, nobody else touches the state
+	if (unsubscribed != stream_id)
+	{
+		if (unsubscribed >= 0)
+			state->unsubscribe(unsubscribed);
+		if (stream_id >= 0)
+			state->subscribe(stream_id);
+	}
+	return state;
+}
+
+bool MediaDecoder::probe(Media* media, MediaInfo* info)
 {
-	return decode(media.get());
+	FfmpegDecoder decoder;
+	return decoder.probe(media->filename(), info);
+}
+
+void MediaDecoder::reopen(DecodingStatePtr state)
+{
+	if (state->is_open())
+		return;
+
+	state->open();
+	enforce_budget(state);
+}
+
+void MediaDecoder::set_budget(size_t max_open, size_t max_bytes)
+{
+	{
+		QMutexLocker lock(&mutex_);
+		max_open_  = max_open;
+		max_bytes_ = max_bytes;
+	}
+	enforce_budget(DecodingStatePtr());
+}
+
+void MediaDecoder::enforce_budget(DecodingStatePtr keep)
+{
+	// Files are closed and threads joined after mutex_ is unlocked. Idle 
+	// states are dropped, busy ones are closed unless they are decoding.
+	std::vector<DecodingStatePtr> dropped;
+	std::vector<DecodingStatePtr> closing;
+
+	{
+		QMutexLocker lock(&mutex_);
+		while (true)
+		{
+			size_t open  = 0;
+			size_t bytes = 0;
+
+			// Idle states go first, then busy ones which weren't used for longest
+			Pool* victim_pool = nullptr;
+			size_t victim     = 0;
+			bool victim_busy  = true;
+			time_mark victim_used = 0;
+
+			for (DecodersIter i = decoders_.begin(); i != decoders_.end(); ++i)
+			{
+				Pool& pool = i->second;
+				for (size_t j = 0; j < pool.size(); ++j)
+				{
+					const Slot& slot = pool[j];
+					if (!slot.state->is_open() || std::find(closing.begin(), closing.end(), slot.state) != closing.end())
+						continue;
+
+					++open;
+					bytes += slot.state->memory();
+
+					if (slot.state == keep)
+						continue;
+
+					time_mark used = slot.state->used_at();
+					bool better = !victim_pool 
+						|| (victim_busy && !slot.busy) 
+						|| (victim_busy == slot.busy && used < victim_used);
+					if (better)
+					{
+						victim_pool = &pool;
+						victim      = j;
+						victim_busy = slot.busy;
+						victim_used = used;
+					}
+				}
+			}
+
+			if ((open <= max_open_ && bytes <= max_bytes_) || !victim_pool)
+				break;
+
+			DecodingStatePtr state = (*victim_pool)[victim].state;
+			if (victim_busy)
+				closing.push_back(state);
+			else
+			{
+				dropped.push_back(state);
+				victim_pool->erase(victim_pool->begin() + victim);
+			}
+		}
+	}
+
+	// Decoding one stays open till next enforcement
+	for (size_t i = 0; i < closing.size(); ++i)
+		closing[i]->try_close();
 }
 
-DecodingStatePtr MediaDecoder::decode(Media* media)
+void MediaDecoder::release(DecodingStatePtr state)
 {
-	DecodersIter found = decoders_.find(media->filename());
-	if (found != decoders_.end())
-		return found->second;
+	QMutexLocker lock(&mutex_);
+
+	for (DecodersIter i = decoders_.begin(); i != decoders_.end(); ++i)
+	{
+		Pool& pool = i->second;
+		for (size_t j = 0; j < pool.size(); ++j)
+		{
+			if (pool[j].state == state)
+			{
+				pool[j].busy      = false;
+				pool[j].last_used = ++clock_;
+				return;
+			}
+		}
+	}
+}
 
+DecodingStatePtr MediaDecoder::open(Media* media)
+{
 	FfmpegDecoder decoder;
-	FfmpegDecodingState* state = (FfmpegDecodingState*) decoder.try_decode(media->filename());
+	FfmpegDecodingState* state = (FfmpegDecodingState*) decoder.try_decode(media->filename(), media->decoding_policy());
+	if (!state)
+		return DecodingStatePtr();
+
 	DecodingStatePtr decoder_ptr = std::shared_ptr<DecodingState>(state);
-	decoders_.insert(std::make_pair(media->filename(), decoder_ptr));
+
+	QMutexLocker lock(&index_mutex_);
+	if (!media->keyframes())
+	{
+		KeyframeIndexPtr keyframes = std::make_shared<KeyframeIndex>();
+		if (decoder_ptr->build_keyframes(keyframes.get()))
+			media->set_keyframes(keyframes);
+	}
+	decoder_ptr->set_keyframes(media->keyframes());
+
 	return decoder_ptr;
 }
 
@@ -47,14 +250,33 @@ PreviewState::PreviewState(Project* project)
 :	project_(project),
 	scene_(nullptr),
 	time_base_(1. / 24. * AV_TIME_BASE),
-	playing_(0)
-{
+	playing_(0),
+	audio_serial_(0),
+	preroller_(nullptr),
+	preroll_ahead_(AV_TIME_BASE),
+	audio_sync_(false),
+	audio_sync_at_(0),
+	audio_scene_(nullptr),
+	audio_base_(0),
+	audio_samples_(0),
+	audio_freq_(0),
+	audio_sample_bytes_(0),
+	audio_track_bytes_(0),
+	audio_position_(0)
+{
+	preroller_ = new MediaPreroller();
+	preroller_->start();
 	sync(0);
 }
 
+PreviewState::~PreviewState()
+{
+	delete preroller_;
+}
+
 void PreviewState::sync(time_mark t)
 {
-	scene_ = project_->time_line()->scene_from_time(t);
+	set_scene(project_->time_line()->scene_from_time(t));
 
 	if (scene_)
 	{
@@ -62,19 +284,92 @@ void PreviewState::sync(time_mark t)
 
 		printf("T: %lld\n", playing_);
 
-		video_clip_ = peek_video_clip(playing_);
+		MediaObjectPtr clip = peek_video_clip(playing_);
+		if (clip != video_clip_ && video_clip_)
+			video_clip_->release_decoder();
+
+		set_video_clip(clip);
 		
+		// Exact frame under cursor, short moves are served from queue
 		if (video_clip_.get())
-			video_clip_->seek(0);
+			video_clip_->seek(playing_ - video_clip_->start());
+
+		// Waits for clip being prerolled, so goes before audio is locked
+		release_prerolled();
+
+		// Audio thread takes it with next block
+		QMutexLocker lock(&audio_mutex_);
+		audio_sync_     = true;
+		audio_sync_at_  = playing_;
+		audio_position_ = playing_;
+		++audio_serial_;
+	}
+}
+
+void PreviewState::sync_audio(time_mark t)
+{
+	sync_audio_tracks(t);
+	audio_base_    = t;
+	audio_samples_ = 0;
+	for (size_t i = 0; i < audio_tracks_.size(); ++i)
+	{
+		AudioTrack& track = audio_tracks_[i];
+		track.pending.reset();
+		enter_audio(track, peek_audio_clip(track.track, t), t);
+	}
+}
+
+void PreviewState::set_video_clip(MediaObjectPtr clip)
+{
+	QMutexLocker lock(&video_mutex_);
+	video_clip_ = clip;
+}
+
+void PreviewState::interrupt()
+{
+	QMutexLocker lock(&video_mutex_);
+	if (video_clip_)
+		video_clip_->interrupt();
+}
+
+void PreviewState::release_prerolled()
+{
+	std::vector<MediaObjectPtr> prerolled = preroller_->cancel();
+	for (size_t i = 0; i < prerolled.size(); ++i)
+	{
+		const MediaObjectPtr& clip = prerolled[i];
+		bool playing = clip == video_clip_;
 
-		audio_clip_ = peek_audio_clip(playing_);
-		if (audio_clip_.get())
-			audio_clip_->seek(0);
+		// Audio thread enters these with its next block. Ones it plays now
+		// are left by it at sync anyway, frames till then are flushed.
+		for (size_t j = 1; j < scene_->tracks_.size(); ++j)
+			playing = playing || clip == peek_audio_clip(scene_->tracks_[j].get(), playing_);
 
-		printf("VA: %p %p\n", video_clip_.get(), audio_clip_.get());
+		if (!playing)
+			clip->release_decoder();
 	}
 }
 
+IFramePtr PreviewState::scrub(time_mark t)
+{
+	set_scene(project_->time_line()->scene_from_time(t));
+	if (!scene_)
+		return IFramePtr();
+
+	playing_ = t;
+
+	MediaObjectPtr clip = peek_video_clip(t);
+	if (clip != video_clip_ && video_clip_)
+		video_clip_->release_decoder();
+
+	set_video_clip(clip);
+	if (!video_clip_)
+		return IFramePtr();
+
+	video_clip_->scrub(t - video_clip_->start());
+	return video_clip_->show_next();
+}
+
 IFramePtr PreviewState::next_video()
 {
 	playing_ += time_base_;
@@ -83,11 +378,21 @@ IFramePtr PreviewState::next_video()
 
 	if (clip != video_clip_)
 	{
-		video_clip_ = clip;
-		if (video_clip_.get())
-			video_clip_->seek(0);
+		if (video_clip_ && clip && clip->continues(*video_clip_))
+			clip->take_over(video_clip_.get());
+		else
+		{
+			if (video_clip_.get())
+				video_clip_->release_decoder();
+			if (clip.get())
+				clip->enter();
+		}
+
+		set_video_clip(clip);
 	}
 
+	preroll_next(video_clip_, peek_video_clip(playing_ + preroll_ahead_));
+
 	IFramePtr video_frame;
 	if (video_clip_.get())
 	{
@@ -100,35 +405,320 @@ IFramePtr PreviewState::next_video()
 
 MovieResourcePtr PreviewState::next_audio()
 {
-	MediaObjectPtr clip = peek_audio_clip(playing_);
+	// Only requests are taken under lock, clip opens go without it
+	PreviewPreset preset;
+	bool sync         = false;
+	time_mark sync_at = 0;
+	u64 serial        = 0;
+	{
+		QMutexLocker lock(&audio_mutex_);
+		preset      = preset_;
+		serial      = audio_serial_;
+		sync        = audio_sync_;
+		sync_at     = audio_sync_at_;
+		audio_sync_ = false;
+		if (sync)
+			audio_scene_ = scene_;
+	}
+
+	if (sync)
+		sync_audio(sync_at);
+
+	if (audio_freq_ <= 0 || !audio_scene_)
+		return MovieResourcePtr();
 
-	if (clip != audio_clip_)
+	// Every track gives exactly one block, so they stay aligned to mix
+	static const size_t block = 1024;
+
+	mixer_.begin(block);
+	for (size_t i = 0; i < audio_tracks_.size(); ++i)
 	{
-		video_clip_ = clip;
-		if (audio_clip_.get())
-			audio_clip_->seek(0);
+		AudioTrack& track = audio_tracks_[i];
+		for (size_t filled = 0; filled < block; )
+		{
+			if (!track.pending)
+			{
+				track.pending    = next_track_audio(track);
+				track.pending_at = 0;
+				if (!track.pending)
+					break;
+			}
+
+			SdlAudioFrame* frame = static_cast<SdlAudioFrame*>(track.pending.get());
+			if (frame->format != SdlFfmpegAudioDecoder::track_format || frame->sample_bytes != audio_track_bytes_)
+			{
+				VD_ERR("Audio frame isn't in mixer format");
+				track.pending.reset();
+				continue;
+			}
+
+			size_t n = std::min(block - filled, frame->samples() - track.pending_at);
+			mixer_.add((const float*) (frame->buf + track.pending_at * frame->sample_bytes), 
+				filled, n, track.track->gain());
+
+			filled           += n;
+			track.pending_at += n;
+			if (track.pending_at >= frame->samples())
+				track.pending.reset();
+		}
 	}
 
-	IFramePtr audio_frame;
-	if (audio_clip_.get())
+	SdlAudioFrame* mixed = new SdlAudioFrame();
+	mixed->freq         = audio_freq_;
+	mixed->format       = AV_SAMPLE_FMT_S16;
+	mixed->sample_bytes = audio_sample_bytes_;
+	mixed->size         = block * audio_sample_bytes_;
+	mixed->serial       = serial;
+	mixed->set_pts(audio_playing());
+	mixer_.end(preset.audio_volume, (int16_t*) mixed->buf);
+
+	audio_samples_ += block;
+
+	// Seek meanwhile has published its own position
+	QMutexLocker lock(&audio_mutex_);
+	if (serial == audio_serial_)
+		audio_position_ = audio_playing();
+
+	return MovieResourcePtr(mixed);
+}
+
+MovieResourcePtr PreviewState::next_track_audio(AudioTrack& track)
+{
+	// Audio runs by its own position, not by video playhead
+	time_mark t = track_playing(track);
+
+	if (!track.clip || t >= track.clip->start() + track.clip->length())
 	{
-		clip->set_playing(playing_ - clip->start());
-		audio_frame = clip->show_next();
+		MediaObjectPtr clip = peek_audio_clip(track.track, t);
+		if (clip != track.clip)
+			enter_audio(track, clip, t);
 	}
-	
-	return audio_frame;
+
+	preroll_next(track.clip, peek_audio_clip(track.track, t + preroll_ahead_));
+
+	if (!track.clip)
+		return silence(track, next_audio_start(track.track, t));
+
+	time_mark clip_end = track.clip->start() + track.clip->length();
+	time_mark out      = track.clip->clip_->start() + track.clip->length();
+	while (true)
+	{
+		IFramePtr frame = track.clip->show_next();
+		SdlAudioFrame* audio_frame = dynamic_cast<SdlAudioFrame*>(frame.get());
+
+		// Frames are over memory limit, decoding goes on with next block
+		if (!audio_frame && !track.clip->finished())
+			return silence(track, std::min(clip_end, t + time_base_));
+
+		// Media is shorter than clip, rest of it is silent
+		if (!audio_frame)
+			break;
+
+		// Belongs to next clip if it continues this one
+		if (audio_frame->pts() >= out)
+		{
+			track.clip->put_back(frame);
+			break;
+		}
+
+		if (!splice(track, audio_frame))
+			continue;
+
+		audio_frame->set_pts(t);
+		track.samples += audio_frame->samples();
+		return frame;
+	}
+
+	return silence(track, clip_end);
+}
+
+void PreviewState::set_audio_format(int freq, int channels)
+{
+	QMutexLocker lock(&audio_mutex_);
+	for (size_t i = 0; i < audio_tracks_.size(); ++i)
+	{
+		audio_tracks_[i].base    = track_playing(audio_tracks_[i]);
+		audio_tracks_[i].samples = 0;
+	}
+
+	audio_base_         = audio_playing();
+	audio_samples_      = 0;
+	audio_freq_         = freq;
+	audio_sample_bytes_ = channels * av_get_bytes_per_sample(AV_SAMPLE_FMT_S16);
+	audio_track_bytes_  = channels * av_get_bytes_per_sample(SdlFfmpegAudioDecoder::track_format);
+	audio_position_     = audio_base_;
+	mixer_.set_format(channels);
+}
+
+time_mark PreviewState::audio_playing() const
+{
+	if (audio_freq_ <= 0)
+		return audio_base_;
+
+	return audio_base_ + audio_samples_ * AV_TIME_BASE / audio_freq_;
+}
+
+u64 PreviewState::audio_serial()
+{
+	QMutexLocker lock(&audio_mutex_);
+	return audio_serial_;
+}
+
+time_mark PreviewState::video_time(time_mark pts) const
+{
+	if (!video_clip_)
+		return pts;
+
+	time_mark in = video_clip_->clip_->start();
+	return video_clip_->start() + (pts > in? pts - in : 0);
+}
+
+time_mark PreviewState::track_playing(const AudioTrack& track) const
+{
+	if (audio_freq_ <= 0)
+		return track.base;
+
+	return track.base + track.samples * AV_TIME_BASE / audio_freq_;
+}
+
+void PreviewState::sync_audio_tracks(time_mark t)
+{
+	std::vector<AudioTrack> tracks;
+	for (size_t i = 1; i < audio_scene_->tracks_.size(); ++i)
+	{
+		AudioTrack state;
+		state.track      = audio_scene_->tracks_[i].get();
+		state.base       = t;
+		state.samples    = 0;
+		state.pending_at = 0;
+
+		// Tracks which stay keep their decoders
+		for (size_t j = 0; j < audio_tracks_.size(); ++j)
+		{
+			if (audio_tracks_[j].track == state.track)
+			{
+				state = audio_tracks_[j];
+				audio_tracks_[j].clip.reset();
+			}
+		}
+
+		tracks.push_back(state);
+	}
+
+	for (size_t j = 0; j < audio_tracks_.size(); ++j)
+	{
+		if (audio_tracks_[j].clip)
+			audio_tracks_[j].clip->release_decoder();
+	}
+
+	audio_tracks_.swap(tracks);
+}
+
+void PreviewState::enter_audio(AudioTrack& track, MediaObjectPtr clip, time_mark t)
+{
+	// Straight from the cut: decoder is at the right point already
+	if (track.clip && clip && at_clip_start(t, *clip) && clip->continues(*track.clip))
+	{
+		clip->take_over(track.clip.get());
+		track.base    = t;
+		track.samples = 0;
+		track.clip    = clip;
+		return;
+	}
+
+	if (track.clip && track.clip != clip)
+		track.clip->release_decoder();
+
+	track.base    = t;
+	track.samples = 0;
+	track.clip    = clip;
+	if (!track.clip)
+		return;
+
+	// Prerolled clip is taken as is, it starts exactly at the cut
+	if (at_clip_start(t, *track.clip))
+		track.clip->enter();
+	else
+		track.clip->seek(t - track.clip->start());
+}
+
+bool PreviewState::at_clip_start(time_mark t, const MediaObject& clip) const
+{
+	time_mark sample = audio_freq_ > 0? std::max<time_mark>(1, AV_TIME_BASE / audio_freq_) : 1;
+	return t < clip.start() + sample;
+}
+
+bool PreviewState::splice(AudioTrack& track, SdlAudioFrame* frame)
+{
+	if (frame->freq <= 0 || frame->samples() == 0)
+		return false;
+
+	// Clip media time expected next and where clip is cut
+	const MediaObjectPtr& clip = track.clip;
+	time_mark in  = clip->clip_->start() + track_playing(track) - clip->start();
+	time_mark out = clip->clip_->start() + clip->length();
+	time_mark end = frame->pts() + frame->samples() * AV_TIME_BASE / frame->freq;
+
+	size_t head = frame->pts() < in?  size_t((in - frame->pts()) * frame->freq / AV_TIME_BASE) : 0;
+	size_t tail = end > out? size_t((end - out) * frame->freq / AV_TIME_BASE) : 0;
+
+	frame->trim(head, tail);
+	return frame->samples() > 0;
+}
+
+MovieResourcePtr PreviewState::silence(AudioTrack& track, time_mark until)
+{
+	if (audio_freq_ <= 0)
+		return MovieResourcePtr();
+
+	time_mark t = track_playing(track);
+
+	// Ends exactly where next clip starts
+	int64_t samples = 1024;
+	if (until > t)
+		samples = std::min<int64_t>(samples, std::max<int64_t>(1, (until - t) * audio_freq_ / AV_TIME_BASE));
+
+	SdlAudioFrame* frame = new SdlAudioFrame();
+	frame->freq         = audio_freq_;
+	frame->format       = SdlFfmpegAudioDecoder::track_format;
+	frame->sample_bytes = audio_track_bytes_;
+	frame->size         = size_t(samples * audio_track_bytes_);
+	memset(frame->buf, 0, frame->size);
+	frame->set_pts(t);
+
+	track.samples += samples;
+	return MovieResourcePtr(frame);
 }
 
 void PreviewState::update_preset(const PreviewPreset& preset)
 {
+	QMutexLocker lock(&audio_mutex_);
 	preset_ = preset;
 }
 
+void PreviewState::set_scene(Scene* scene)
+{
+	QMutexLocker lock(&audio_mutex_);
+	scene_ = scene;
+}
+
 time_mark PreviewState::time_base()
 {
 	return time_base_;
 }
 
+void PreviewState::preroll_next(const MediaObjectPtr& current, MediaObjectPtr next)
+{
+	if (!next || next == current || next->prerolled())
+		return;
+
+	// Will get decoder of current clip at the cut
+	if (current && next->continues(*current))
+		return;
+
+	preroller_->schedule(next);
+}
+
 MediaObjectPtr PreviewState::peek_video_clip(time_mark t)
 {
 	MediaObjectPtr clip = fun::find<MediaObjectPtr>(scene_->tracks_[0]->comps_, MediaObjectPtr(),
@@ -138,15 +728,264 @@ MediaObjectPtr PreviewState::peek_video_clip(time_mark t)
 	return clip;
 }
 
-MediaObjectPtr PreviewState::peek_audio_clip(time_mark t)
+MediaObjectPtr PreviewState::peek_audio_clip(const TimeLineTrack* track, time_mark t)
 {
-	MediaObjectPtr clip = fun::find<MediaObjectPtr>(scene_->tracks_[1]->comps_, MediaObjectPtr(),
+	// Clip end isn't included: at the cut next clip is already played
+	MediaObjectPtr clip = fun::find<MediaObjectPtr>(track->comps_, MediaObjectPtr(),
 		[&] (const MediaObjectPtr& clip)->bool {
-			return clip->start() <= t && t <= clip->start() + clip->length();
+			return clip->start() <= t && t < clip->start() + clip->length();
 	});
 	return clip;
 }
 
+time_mark PreviewState::next_audio_start(const TimeLineTrack* track, time_mark t)
+{
+	time_mark next = 0;
+	const TimeLineTrack::MediaClips& clips = track->comps_;
+	for (TimeLineTrack::MediaClips::const_iterator i = clips.begin(); i != clips.end(); ++i)
+	{
+		if ((*i)->start() > t && (next == 0 || (*i)->start() < next))
+			next = (*i)->start();
+	}
+	return next;
+}
+
+
+//
+// MediaPreroller
+//
+MediaPreroller::MediaPreroller()
+:	stop_(false)
+{
+}
+
+MediaPreroller::~MediaPreroller()
+{
+	stop();
+	wait();
+}
+
+void MediaPreroller::stop()
+{
+	QMutexLocker lock(&mutex_);
+	stop_ = true;
+	pending_.clear();
+	wake_.wakeAll();
+}
+
+void MediaPreroller::schedule(MediaObjectPtr clip)
+{
+	QMutexLocker lock(&mutex_);
+	if (clip == current_ || std::find(pending_.begin(), pending_.end(), clip) != pending_.end())
+		return;
+
+	pending_.push_back(clip);
+	wake_.wakeAll();
+}
+
+void MediaPreroller::run()
+{
+	while (true)
+	{
+		MediaObjectPtr clip;
+		{
+			QMutexLocker lock(&mutex_);
+			while (!stop_ && pending_.empty())
+				wake_.wait(&mutex_);
+
+			if (stop_)
+				break;
+
+			clip = pending_.front();
+			pending_.pop_front();
+			current_ = clip;
+		}
+
+		clip->preroll();
+
+		QMutexLocker lock(&mutex_);
+		if (std::find(done_.begin(), done_.end(), clip) == done_.end())
+			done_.push_back(clip);
+		current_.reset();
+		idle_.wakeAll();
+	}
+}
+
+std::vector<MediaObjectPtr> MediaPreroller::cancel()
+{
+	QMutexLocker lock(&mutex_);
+	pending_.clear();
+	while (current_)
+		idle_.wait(&mutex_);
+
+	std::vector<MediaObjectPtr> done;
+	done.swap(done_);
+	return done;
+}
+
+//
+// MediaPrefetcher
+//
+MediaPrefetcher::MediaPrefetcher()
+:	stop_(false),
+	lookahead_(4 * AV_TIME_BASE),
+	last_playhead_(0),
+	updated_(false)
+{
+}
+
+MediaPrefetcher::~MediaPrefetcher()
+{
+	stop();
+	wait();
+}
+
+void MediaPrefetcher::stop()
+{
+	QMutexLocker lock(&mutex_);
+	stop_ = true;
+	wake_.wakeAll();
+}
+
+void MediaPrefetcher::update(Scene* scene, time_mark playhead)
+{
+	if (!scene)
+		return;
+
+	// Moving back means seek: everything may be evicted since
+	if (playhead < last_playhead_)
+	{
+		QMutexLocker lock(&mutex_);
+		warmed_.clear();
+	}
+	else if (updated_ && playhead - last_playhead_ < lookahead_ / 4)
+		return;
+
+	updated_       = true;
+	last_playhead_ = playhead;
+
+	std::vector<Request> requests;
+	time_mark end = playhead + lookahead_;
+	for (Scene::TracksIter i = scene->tracks_.begin(); i != scene->tracks_.end(); ++i)
+	{
+		TimeLineTrack::MediaClips& clips = (*i)->comps_;
+		for (TimeLineTrack::MediaClipsIter j = clips.begin(); j != clips.end(); ++j)
+		{
+			MediaObject* obj = j->get();
+			if (obj->start() + obj->length() < playhead || obj->start() > end)
+				continue;
+
+			// Window on timeline to media time of clip
+			Request request;
+			request.media = obj->clip_->media();
+			request.from  = std::max(playhead, obj->start()) - obj->start() + obj->clip_->start();
+			request.to    = std::min(end, obj->start() + obj->length()) - obj->start() + obj->clip_->start();
+			requests.push_back(request);
+		}
+	}
+
+	QMutexLocker lock(&mutex_);
+	pending_.insert(pending_.end(), requests.begin(), requests.end());
+	wake_.wakeAll();
+}
+
+bool MediaPrefetcher::byte_range(Media* media, time_mark from, time_mark to, Range* range)
+{
+	range->filename = media->filename();
+
+	KeyframeIndexPtr keyframes = media->keyframes();
+	if (keyframes && !keyframes->empty())
+	{
+		const KeyframeIndex::Entry* first = keyframes->find(from);
+		const KeyframeIndex::Entry* last  = keyframes->after(to);
+		range->from = first && first->pos >= 0? first->pos : 0;
+		range->to   = last && last->pos >= 0? last->pos : -1; // Till file end
+		return true;
+	}
+
+	// Not opened yet: guess by average bitrate
+	MediaInfo info = media->info();
+	int64_t size = QFileInfo(QString::fromStdString(media->filename())).size();
+	if (!info.probed || info.duration == 0 || size <= 0)
+		return false;
+
+	range->from = int64_t(double(size) * from / info.duration);
+	range->to   = std::min(size, int64_t(double(size) * to / info.duration) + 1);
+	return true;
+}
+
+bool MediaPrefetcher::claim(Range* range)
+{
+	QMutexLocker lock(&mutex_);
+
+	int64_t to = range->to >= 0? range->to : std::numeric_limits<int64_t>::max();
+	std::map<AString, std::pair<int64_t, int64_t> >::iterator i = warmed_.find(range->filename);
+	if (i != warmed_.end())
+	{
+		std::pair<int64_t, int64_t>& span = i->second;
+		if (range->from >= span.first && to <= span.second)
+			return false;
+
+		// Continues warmed span, only the rest is read
+		if (range->from >= span.first && range->from <= span.second)
+		{
+			range->from = span.second;
+			span.second = to;
+			return true;
+		}
+	}
+
+	warmed_[range->filename] = std::make_pair(range->from, to);
+	return true;
+}
+
+void MediaPrefetcher::run()
+{
+	while (true)
+	{
+		Request request;
+		{
+			QMutexLocker lock(&mutex_);
+			while (!stop_ && pending_.empty())
+				wake_.wait(&mutex_);
+
+			if (stop_)
+				break;
+
+			request = pending_.front();
+			pending_.pop_front();
+		}
+
+		Range range;
+		if (byte_range(request.media.get(), request.from, request.to, &range) && claim(&range))
+			warm(range);
+	}
+}
+
+void MediaPrefetcher::warm(const Range& range)
+{
+	QFile file(QString::fromStdString(range.filename));
+	if (!file.open(QIODevice::ReadOnly))
+		return;
+
+	int64_t to = range.to >= 0? std::min(range.to, file.size()) : file.size();
+	if (to <= range.from)
+		return;
+
+#ifdef Q_OS_UNIX
+	// Kernel reads ahead itself, nothing is copied here
+	posix_fadvise(file.handle(), range.from, to - range.from, POSIX_FADV_WILLNEED);
+#else
+	static const qint64 chunk = 1024 * 1024;
+	std::vector<char> buf(chunk);
+	file.seek(range.from);
+	for (int64_t at = range.from; at < to && !stop_; at += chunk)
+	{
+		if (file.read(&buf[0], std::min<int64_t>(chunk, to - at)) <= 0)
+			break;
+	}
+#endif
+}
 
 //
 // MediaClip
@@ -163,62 +1002,268 @@ MediaClip::MediaClip(MediaPtr media)
 //
 MediaObject::MediaObject()
 :	TimeLineObject(nullptr),
-	stream_id_(-1)
+	stream_id_(-1),
+	prerolled_(false),
+	scrubbed_(false)
+{
+}
+
+MediaObject::~MediaObject()
 {
+	release_decoder();
 }
 
 void MediaObject::setup(MediaClip* clip, int stream_id, PresenterPtr presenter)
 {
 	clip_.reset(clip);
-	decoder_   = MediaDecoder::i().decode(clip->media());
 	presenter_ = presenter;
 	stream_id_ = stream_id;
 }
 
+void MediaObject::acquire_decoder(time_mark position)
+{
+	if (decoder_)
+		return;
+
+	DecodingStatePtr decoder = MediaDecoder::i().acquire(clip_->media().get(), position, stream_id_);
+
+	QMutexLocker lock(&decoder_mutex_);
+	decoder_ = decoder;
+}
+
+void MediaObject::release_decoder()
+{
+	QMutexLocker lock(&mutex_);
+	do_release();
+}
+
+void MediaObject::do_release()
+{
+	prerolled_ = false;
+	if (!decoder_)
+		return;
+
+	frames_.clear();
+	MediaDecoder::i().release(decoder_);
+
+	QMutexLocker lock(&decoder_mutex_);
+	decoder_.reset();
+}
+
 void MediaObject::seek(time_mark t)
 {
+	QMutexLocker lock(&mutex_);
+	prerolled_ = false;
+	do_seek(t);
+}
+
+void MediaObject::preroll()
+{
+	QMutexLocker lock(&mutex_);
+	// Clip with decoder is being played already
+	if (prerolled_ || decoder_)
+		return;
+
+	do_seek(0);
+	// Interrupted or failed one is sought again on enter
+	prerolled_ = decoder_ && !frames_.empty();
+}
+
+void MediaObject::interrupt()
+{
+	QMutexLocker lock(&decoder_mutex_);
+	if (decoder_)
+		decoder_->interrupt();
+}
+
+void MediaObject::enter()
+{
+	QMutexLocker lock(&mutex_);
+	// Waits here for preroll if it's still in progress
+	if (!prerolled_)
+		do_seek(0);
+	prerolled_ = false;
+}
+
+bool MediaObject::continues(const MediaObject& prev) const
+{
+	if (!prev.decoder_ || stream_id_ != prev.stream_id_ || clip_->media() != prev.clip_->media())
+		return false;
+
+	// Clip bounds are rounded to microseconds
+	static const time_mark tolerance = AV_TIME_BASE / 1000;
+	time_mark prev_out = prev.clip_->start() + prev.length();
+	time_mark in       = clip_->start();
+	return (prev_out > in? prev_out - in : in - prev_out) <= tolerance;
+}
+
+void MediaObject::take_over(MediaObject* prev)
+{
+	QMutexLocker prev_lock(&prev->mutex_);
+	QMutexLocker lock(&mutex_);
+
+	do_release();
+
+	{
+		QMutexLocker prev_decoder_lock(&prev->decoder_mutex_);
+		QMutexLocker decoder_lock(&decoder_mutex_);
+		decoder_.swap(prev->decoder_);
+	}
+	frames_.swap(prev->frames_);
+	read_pts_  = prev->read_pts_;
+	ready_pts_ = prev->ready_pts_;
+	scrubbed_  = prev->scrubbed_;
+	prev->prerolled_ = false;
+}
+
+bool MediaObject::finished()
+{
+	QMutexLocker lock(&mutex_);
+	return frames_.empty() && (!decoder_ || decoder_->finished(stream_id_));
+}
+
+void MediaObject::put_back(IFramePtr frame)
+{
+	QMutexLocker lock(&mutex_);
+	frames_.push_front(frame);
+	ready_pts_ = frame->pts();
+}
+
+void MediaObject::scrub(time_mark t)
+{
+	QMutexLocker lock(&mutex_);
+	prerolled_ = false;
+
+	time_mark target = clip_->start() + t;
+	acquire_decoder(target);
+	if (!decoder_)
+		return;
+
+	MediaDecoder::i().reopen(decoder_);
+
+	frames_.clear();
+	decoder_->seek_key(target);
+	scrubbed_ = true;
+
+	// One keyframe is shown, next move seeks again
+	read_pts_ = ready_pts_ = target;
+	IFramePtr frame = decoder_->peek_frame(stream_id_);
+	if (frame)
+	{
+		frames_.push_back(presenter_->prepare(frame));
+		read_pts_ = ready_pts_ = frame->pts();
+	}
+}
+
+void MediaObject::do_seek(time_mark t)
+{
+	time_mark target = clip_->start() + t;
+	if (decoder_ && !scrubbed_ && (seek_in_queue(target) || seek_forward(target)))
+		return;
+
+	scrubbed_ = false;
+
+	bool acquired = !decoder_;
+	acquire_decoder(target);
+	if (!decoder_)
+		return;
+
+	MediaDecoder::i().reopen(decoder_);
+
+	// Pool gave state which stopped shortly before target: decode on from there
+	if (acquired && !decoder_->key_only() && decoder_->position() < target)
+	{
+		frames_.clear();
+		read_pts_ = ready_pts_ = decoder_->position();
+		if (seek_forward(target))
+			return;
+	}
+
 	frames_.clear(); 
-	read_pts_ = ready_pts_ = t;
+	// Decoder pre-rolls itself to the target, frames come in media time
+	read_pts_ = ready_pts_ = clip_->start() + t;
 	decoder_->seek(clip_->start() + t);
 	preload_next();
 }
 
+bool MediaObject::seek_in_queue(time_mark target)
+{
+	if (frames_.empty() || target < frames_.front()->pts() || target > read_pts_)
+		return false;
+
+	while (!frames_.empty() && frames_.front()->ends_before(target))
+		frames_.pop_front();
+
+	preload_next();
+	return true;
+}
+
+bool MediaObject::seek_forward(time_mark target)
+{
+	// Longer distances are cheaper with seek even inside one GOP
+	static const time_mark max_forward = 2 * AV_TIME_BASE;
+	// Without index only very short jumps are decoded through
+	static const time_mark short_forward = AV_TIME_BASE / 4;
+
+	if (target <= read_pts_ || target - read_pts_ > max_forward || !decoder_->is_open())
+		return false;
+
+	// Seek would start from keyframe before read position and decode even more
+	KeyframeIndexPtr keyframes = clip_->media()->keyframes();
+	const KeyframeIndex::Entry* key = keyframes? keyframes->find(target) : nullptr;
+	bool cheaper = key? key->pts <= read_pts_ : target - read_pts_ <= short_forward;
+	if (!cheaper)
+		return false;
+
+	frames_.clear();
+	while (true)
+	{
+		IFramePtr frame = decoder_->peek_frame(stream_id_);
+		if (!frame)
+			break;
+
+		// Skipped ones aren't prepared, it's the most of the cost
+		if (!frame->ends_before(target))
+		{
+			frames_.push_back(presenter_->prepare(frame));
+			read_pts_ = frame->pts();
+			break;
+		}
+	}
+
+	preload_next();
+	return true;
+}
+
 void MediaObject::preload_next()
 {
-	int skipped = 0;
 	while (frames_.size() < 30)
 	{
 		IFramePtr frame = decoder_->peek_frame(stream_id_);
-
-		
+		if (!frame)
+			break;
 
 		//if (frame->pts() > clip_->start() + length())
 		//	break; 
 
-		if (frame->pts() < read_pts_)
-		{
-			printf("(%lld) ", frame->pts());
-			++skipped;
-			continue;
-		}
-		else
-			printf("%lld ", frame->pts());
-
-		
-
 		IFramePtr prepared_frame = presenter_->prepare(frame);
 		frames_.push_back(prepared_frame);
-		//read_pts_ = std::max(prepared_frame->pts(), read_pts_);
+		read_pts_ = std::max(frame->pts(), read_pts_);
 	}
 
-	printf("SK: %d\n", skipped);
-
 	if (!frames_.empty())
 		ready_pts_ = frames_.front()->pts();
 }
 
 IFramePtr MediaObject::show_next()
 {
+	QMutexLocker lock(&mutex_);
+	if (!decoder_)
+		do_seek(playing());
+
+	if (!decoder_)
+		return IFramePtr(nullptr);
+
 	if (frames_.empty())
 		preload_next();
 
@@ -238,6 +1283,8 @@ void MediaObject::set_length(time_mark length)
 
 time_mark MediaObject::time_base() const
 {
+	if (!decoder_)
+		return 0;
 	return decoder_->time_base(stream_id_);
 }
 
@@ -404,10 +1451,15 @@ void TimeLineWidget::cursor_updated()
 	current_ = mapFromScene(QPointF(cursor_->current(), 0)).x();
 	time_mark time = pos2time(current_);
 	notify_current_preview_time(time);
-	preview_->seek(time);
+	preview_->post_seek(time);
 	repaint();
 }
 
+void TimeLineWidget::set_scrubbing(bool scrubbing)
+{
+	preview_->set_scrubbing(scrubbing);
+}
+
 void TimeLineWidget::pose_cursor(float current)
 {
 	current_ = current;
@@ -514,6 +1566,7 @@ void TimeLineCursorWidget::mousePressEvent(QGraphicsSceneMouseEvent* ev)
 {
     ev->accept();
     offset_ = ev->pos();
+	parent_->set_scrubbing(true);
 }
 
 void TimeLineCursorWidget::mouseMoveEvent(QGraphicsSceneMouseEvent* ev)
@@ -528,6 +1581,7 @@ void TimeLineCursorWidget::mouseReleaseEvent(QGraphicsSceneMouseEvent* ev)
 {
     ev->accept();
     offset_ = QPoint();
+	parent_->set_scrubbing(false);
 }
 
 void TimeLineCursorWidget::paint(QPainter* painter, const QStyleOptionGraphicsItem* option, QWidget* widget)
@@ -730,6 +1784,7 @@ Scene::Scene(Project* project)
 void Scene::_create_test() 
 {
 	MediaPtr media = std::make_shared<Media>("test.mp4");
+	media->set_decoding_policy(DecodingPolicy::preview());
 
 	PresenterPtr video_presenter = project_->video_presenter();
 	PresenterPtr audio_presenter = project_->audio_presenter();